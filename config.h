@@ -13,6 +13,18 @@
  * Macros
  */
 #define NUM_TRACKS              999
+#define PLAYER_QUEUE_SIZE       16      // Pending player commands, must be a power of two
+#define PLAYER_EVENT_QUEUE_SIZE 8       // Frames received from the player, must be a power of two
+#define KEY_EVENT_QUEUE_SIZE    8       // Key presses waiting to be handled, must be a power of two
+#define SOUND_QUEUE_SIZE        4       // Melodies waiting to be played, must be a power of two
+#define WEIGHTED_SHUFFLE        0       // 1 to pick random tracks by their statistics
+                                        // instead of going through a shuffled playlist
+#define SHUFFLE_AUTO_ADVANCE    1       // 1 to keep shuffling when a random track ends,
+                                        // 0 to carry on with the next track in order
+#define HISTORY_SIZE            32      // Tracks that Previous can go back through, must be a power of two
+#define UPCOMING_SIZE           8       // Queued tracks, must be a power of two
+#define DIAL_ENQUEUE            0       // 1 to queue a number dialed while a track plays,
+                                        // 0 to play it at once. The extra button always plays it
 
 /**
  * GPIO definitions
@@ -33,21 +45,90 @@
 #define GPIO_RX                 21 // UART RX pin
 #define DFPLAYER_UART           uart1
 
-#define BUSY_PIN                22  // Implemented but not used
+#define BUSY_PIN                22
 #define BUSY_PIN_DESCRIPTION    "DFPlayer BUSY pin"
+#define USE_BUSY_PIN            1   // Detect track start and end from the BUSY pin
+                                    // instead of polling the player status
 
 #define POWER_ON_LED_PIN        PICO_DEFAULT_LED_PIN
 #define POWER_ON_LED_PIN_DESCRIPTION        "Power-on LED"
 
+#define BATTERY_PIN             29  // VSYS / 3 on the Raspberry Pi Pico
+#define BATTERY_PIN_DESCRIPTION "Battery voltage"
+#define BATTERY_ADC_INPUT       3
+#define BATTERY_DIVIDER         3
+
+/**
+ * Play statistics
+ */
+#define STATS_SAVE_INTERVAL_MS  900000  // Statistics are saved to flash at most this often,
+                                        // and when entering the low-power idle mode
+#define STATS_SKIP_MS           30000   // A track left before this counts as skipped
+#define WEIGHT_BASE             8       // Weighted shuffle: weight of a track with no statistics,
+#define WEIGHT_COMPLETED        1       // raised for each time it was played to the end,
+#define WEIGHT_SKIPPED          2       // and lowered for each skip, down to 1
+#define WEIGHTED_NO_REPEAT      8       // Latest tracks the weighted shuffle does not pick again
+#define WEIGHTED_TRIES          8       // Picks before settling for a recent track
+
+/**
+ * Battery
+ */
+#define BATTERY_CAPACITY_MAH    2500
+#define BATTERY_PLAYING_MA      120     // Average load while playing
+#define BATTERY_IDLE_MA         30      // Average load when not playing
+#define BATTERY_SAVING_MV       3500    // Power-saving profile below this voltage
+#define BATTERY_CRITICAL_MV     3300    // Low battery warning below this voltage
+#define BATTERY_HYSTERESIS_MV   100     // Back to a higher profile this far above its threshold
+#define BATTERY_BURST_SAMPLES   16      // ADC samples averaged for each reading
+#define BATTERY_SAMPLE_HZ       800     // Spreads a burst over 20ms of audio
+#define POWER_SAVING_CLOCK_KHZ  48000   // System clock in the power-saving profile
+#define POWER_SAVING_POLL_FACTOR 4      // Status polling slows down by this factor
+#define LED_SAVING_LEVEL        32      // LED brightness in the power-saving profile, out of 255
+
 /**
  * Timers and delays
  */
 #define BLINK_DURATION_MS       100
+#define BATTERY_CHECK_MS        5000
 #define BEEP_DURATION_MS        50
-#define PLAYER_POLL_MS          350     // Should be > 200ms
-#define KEYPAD_DEBOUNCE_US      250000
-#define INPUT_TIMEOUT_MS        1000    // After this interval, any unsubmitted input
-                                        // will be discarded
+#define MELODY_TEMPO            120     // Beats per minute of the buzzer melodies
+#define DFPLAYER_INIT_TIMEOUT_MS 3000   // Commands are held until the player reports it
+                                        // has booted, or for this long after power-on
+#define PLAYER_POLL_MS          350     // Status polling interval when idle
+#define DFPLAYER_MIN_GAP_MS     150     // Minimum interval between two frames sent to the
+                                        // player until its profile is known. Some clones need 200ms or more
+#define PLAYER_PROFILE          -1      // -1 to probe the player at boot, or one of the PROFILE_
+                                        // indexes below to skip the probe
+#define PLAYER_PROBE_TIMEOUT_MS 300     // Wait for the reply to a probe status query
+#define PLAYER_PROBE_FAST_MS    40      // Players replying faster than this get PROFILE_FAST
+#define BUSY_GLITCH_MS          30      // BUSY pin must be stable this long to count
+#define PLAY_SETTLE_MS          500     // Track end reports are ignored this soon after a PLAY
+#define FADE_TRANSITIONS        1       // Fade out before a track change or a pause, and back in
+#define FADE_MS                 450     // Length of a fade, stepped at the pace of the player profile
+#define BUSY_STATUS_CHECK_MS    5000    // Status sanity check interval when using the BUSY pin
+#define KEYPAD_SCAN_MS          10
+#define KEYPAD_DEBOUNCE_US      100000  // Per key: other keys can be pressed meanwhile
+#define POWER_IDLE_TIMEOUT_MS   30000   // Enter the low-power idle mode after this long
+                                        // without playback or input
+#define POWER_IDLE_CLOCK_KHZ    48000   // System clock while idle
+#define STATE_SAVE_DELAY_MS     3000    // Playback state is saved to flash once it has
+                                        // not changed for this long
+#define VOLUME_RAMP_MS          150     // Volume step interval while a volume key is held
+#define INPUT_TIMEOUT_MS        1000    // After this interval, the number typed is played.
+                                        // Longest wait, for slow dialling
+#define INPUT_TIMEOUT_MIN_MS    400     // Shortest wait, for fast dialling
+
+/**
+ * Platform tuning
+ */
+#if PICO_RP2350
+#define RUN_CLOCK_KHZ           96000   // System clock. The lower clocks are divided down
+                                        // from it, so they must be a fraction of it
+#define TRACK_INDEX_IN_RAM      1       // Genre of each track looked up in a table in SRAM
+#else
+#define RUN_CLOCK_KHZ           SYS_CLK_KHZ
+#define TRACK_INDEX_IN_RAM      0
+#endif
 
 /**
  * Definitions
@@ -57,16 +138,146 @@
 
 #define STATUS                  0
 #define PLAY                    1
-#define VOLUMEDOWN              2
-#define VOLUMEUP                3
-#define EQ                      4
-#define PAUSE                   5
-#define RESUME                  6
+#define VOLUME                  2
+#define EQ                      3
+#define PAUSE                   4
+#define RESUME                  5
+#define FILE_COUNT              6
+#define FADE                    7       // Volume step of a transition, sent by the player engine only
+
+#define VOLUME_MIN              0
+#define VOLUME_MAX              30
+#define VOLUME_DEFAULT          1       // Be careful, as it can get dangerously
+                                        // loud for a headset
+#define VOLUME_CEILING          30      // Highest volume the keys can set. Lower it
+                                        // to keep a headset at a safe level
+
+#define KEY_NONE                0
+#define KEY_DIGIT               1
+#define KEY_PREV                2
+#define KEY_NEXT                3
+#define KEY_RANDOM              4
+#define KEY_VOLUMEDOWN          5
+#define KEY_VOLUMEUP            6
+#define KEY_REPEAT              7
+#define KEY_PAUSE               8
+#define KEY_EQ                  9
+#define KEY_PREV_GENRE          10
+#define KEY_NEXT_GENRE          11
+#define KEY_GENRE_SHUFFLE       12      // Shuffle within the current genre, or all tracks again
+#define KEY_ENTER               13      // Play the number typed without waiting. Not on the
+                                        // keypad: the extra button does it, or the remote control
+#define KEY_VOLUMEDOWN_RAMP     14      // Lower the volume for as long as the key is held
+#define KEY_VOLUMEUP_RAMP       15      // Raise the volume for as long as the key is held
 
 /**
  * Debugging
  */
-#define DEBUG                   1
+#define DEBUG                   0       // Human-readable log on the USB console
+#define TRACE                   1       // Timestamped event trace, cheap enough to leave on
+#define TRACE_BUFFER_SIZE       128     // Trace records per core, must be a power of two
+#define REMOTE                  1       // Binary remote control and telemetry on the USB console
+#define REMOTE_RX_MAX           32      // Bytes read from the host per main loop pass
+#ifndef BENCHMARK
+#define BENCHMARK               0       // Set by the Jukephone_benchmark target: injects
+#endif                                  // key presses and track ends, and reports latencies
+#define BENCHMARK_INTERVAL_MS   500     // Between two synthetic events
+#define BENCHMARK_REPORT_MS     10000
+#define BENCHMARK_SAMPLES       128     // Latest samples kept for each stage
+#define SHUFFLE_SEED            0       // Set to a seed printed on the debug console
+                                        // to replay its shuffled playlists. 0 is random
+
+/**
+ * Keypad layout, indexed by the key number reported by the keypad matrix.
+ * Each key has an action, its argument, a feedback tone (0 for none)
+ * and an action for the long press.
+ * Note: on the specific telephone I used, the bottom left key (mute)
+ * is not part of the keypad matrix and is connected to its own pin.
+ * See button_onchange() in main.c.
+ */
+struct key_t {
+    uint8_t action;
+    uint8_t arg;
+    uint16_t tone;
+    uint8_t long_action;
+};
+
+const struct key_t KEYMAP[] = {
+    // Numbers
+    [0]  = {KEY_DIGIT, 1, NOTE_C4,  KEY_NONE},
+    [1]  = {KEY_DIGIT, 2, NOTE_CS4, KEY_NONE},
+    [2]  = {KEY_DIGIT, 3, NOTE_D4,  KEY_NONE},
+    [5]  = {KEY_DIGIT, 4, NOTE_DS4, KEY_NONE},
+    [6]  = {KEY_DIGIT, 5, NOTE_E4,  KEY_NONE},
+    [7]  = {KEY_DIGIT, 6, NOTE_F4,  KEY_NONE},
+    [10] = {KEY_DIGIT, 7, NOTE_FS4, KEY_NONE},
+    [11] = {KEY_DIGIT, 8, NOTE_G4,  KEY_NONE},
+    [12] = {KEY_DIGIT, 9, NOTE_GS4, KEY_NONE},
+    [15] = {KEY_DIGIT, 0, NOTE_AS4, KEY_EQ},
+    // Prev / Next (asterisk and little gate sign keys)
+    [16] = {KEY_PREV, 0, NOTE_A4, KEY_PREV_GENRE},
+    [17] = {KEY_NEXT, 0, NOTE_B4, KEY_NEXT_GENRE},
+    // Additional keys
+    [3]  = {KEY_RANDOM,     0, 0, KEY_GENRE_SHUFFLE},
+    [19] = {KEY_VOLUMEDOWN, 0, 0, KEY_VOLUMEDOWN_RAMP},
+    [13] = {KEY_VOLUMEUP,   0, 0, KEY_VOLUMEUP_RAMP},
+    [8]  = {KEY_REPEAT,     0, 0, KEY_NONE},
+    [18] = {KEY_PAUSE,      0, 0, KEY_NONE},
+};
+
+/**
+ * Player profiles. The chips found on DFPlayer clones (MH2024K-24K,
+ * MH2024K-16SS and more) differ in how fast they accept commands and in
+ * how they handle status queries and checksums. At boot, the player is
+ * sent a status query and its reply selects one of these profiles.
+ */
+struct player_profile_t {
+    const char *name;
+    uint16_t min_gap_ms;        // Between two frames sent to the player
+    uint16_t poll_ms;           // Status polling interval, when not using the BUSY pin
+    bool status;                // Status replies can be trusted
+    bool checksum_tx;           // Frames are sent with a checksum
+    bool checksum_rx;           // Frames received with a wrong checksum are dropped
+};
+
+#define PROFILE_FAST            0       // Replies quickly
+#define PROFILE_STANDARD        1       // Replies, but slower
+#define PROFILE_NO_CHECKSUM     2       // Only replies to frames sent without a checksum
+#define PROFILE_LENIENT_RX      3       // Replies with a wrong checksum
+#define PROFILE_NO_STATUS       4       // Does not reply: relies on the BUSY pin
+#define PROFILE_LENIENT_RX_NO_CHECKSUM 5 // Replies with a wrong checksum, only to frames without one
+
+const struct player_profile_t PLAYER_PROFILES[] = {
+    [PROFILE_FAST]          = {"fast",          60,                  150,            true,  true,  true},
+    [PROFILE_STANDARD]      = {"standard",      100,                 250,            true,  true,  true},
+    [PROFILE_NO_CHECKSUM]   = {"no checksum",   DFPLAYER_MIN_GAP_MS, PLAYER_POLL_MS, true,  false, true},
+    [PROFILE_LENIENT_RX]    = {"lenient rx",    DFPLAYER_MIN_GAP_MS, PLAYER_POLL_MS, true,  true,  false},
+    [PROFILE_NO_STATUS]     = {"no status",     DFPLAYER_MIN_GAP_MS, PLAYER_POLL_MS, false, true,  true},
+    [PROFILE_LENIENT_RX_NO_CHECKSUM] = {"lenient rx, no checksum", DFPLAYER_MIN_GAP_MS, PLAYER_POLL_MS, true, false, false},
+};
+
+/**
+ * Track index: the range of tracks of each genre on the microSD card,
+ * in ascending order. Tracks outside of any range are only reachable
+ * by number or by stepping through them.
+ */
+struct genre_t {
+    uint16_t first;
+    uint16_t last;
+};
+
+const struct genre_t GENRES[] = {
+    {1,   99},
+    {100, 199},
+    {200, 299},
+    {300, 399},
+    {400, 499},
+    {500, 599},
+    {600, 699},
+    {700, 799},
+    {800, 899},
+    {900, 999},
+};
 
 /**
  * Melodies for the buzzer
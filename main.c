@@ -9,11 +9,22 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
 #include <pico/stdlib.h>
+#include "pico/rand.h"          // Needed to seed the shuffled playlist
 #include "hardware/adc.h"       // Needed for battery level monitoring
+#include "hardware/dma.h"       // Needed to sample the battery in the background
+#include "hardware/sync.h"      // Needed to guard the player command queue
+#include "hardware/irq.h"       // Needed to receive frames from the player
+#include "hardware/clocks.h"    // Needed to lower the clock when idle
+#include "hardware/timer.h"     // Needed by the timer scheduler
+#include "hardware/pwm.h"       // Needed to drive the buzzer
+#include "hardware/flash.h"     // Needed to persist the playback state
+#include "pico/flash.h"
+#include "pico/multicore.h"     // Needed to run the player engine on core 1
 #include "dfplayer.h"           // https://github.com/TuriSc/RP2040-DFPlayer
 #include "keypad.h"             // https://github.com/TuriSc/RP2040-Keypad-Matrix
-#include "battery-check.h"      // https://github.com/TuriSc/RP2040-Battery-Check
 #include "button.h"             // https://github.com/TuriSc/RP2040-Button
 #include "pwm-tone.h"           // https://github.com/TuriSc/RP2040-PWM-Tone
 
@@ -28,25 +39,198 @@
 #endif
 
 /**
- * @brief Alarm IDs for various events
+ * @brief Frames sent by the player
  */
-static alarm_id_t power_on_alarm;
-static alarm_id_t blink_alarm;
-static alarm_id_t type_timeout_alarm;
-static alarm_id_t scheduled_play_alarm;
-static alarm_id_t loading_track_alarm;
-static repeating_timer_t status_timer;
-static repeating_timer_t low_batt_pulse_timer;
+#define FRAME_SIZE              10
+#define FRAME_START             0x7E
+#define FRAME_END               0xEF
+#define FRAME_PLAY_FINISHED     0x3D
+#define FRAME_READY             0x3F
+#define FRAME_ERROR             0x40
+#define FRAME_STATUS            0x42
+#define FRAME_FILE_COUNT        0x48
+#define FRAME_PLAY              0x03    // Commands sent to the player
+#define FRAME_VOLUME            0x06
+#define FRAME_EQ                0x07
+#define FRAME_RESUME            0x0D
+#define FRAME_PAUSE             0x0E
+#define FRAME_VERSION           0xFF
+#define FRAME_LENGTH            0x06
+
+#define ERROR_OUT_OF_RANGE      0x05    // Arguments of FRAME_ERROR
+#define ERROR_NOT_FOUND         0x06
+
+/**
+ * @brief Number of genres in the track index
+ */
+#define NUM_GENRES              count_of(GENRES)
+
+/**
+ * @brief Number of Feistel rounds of the shuffled playlist permutation
+ */
+#define SHUFFLE_ROUNDS          4
+
+/**
+ * @brief Playback state log, in the last sectors of the flash
+ */
+#define STATE_SECTORS           2
+#define STATE_OFFSET            (PICO_FLASH_SIZE_BYTES - STATE_SECTORS * FLASH_SECTOR_SIZE)
+#define STATE_MAGIC             0x4A4B5031 // "JKP1"
+#define STATS_SECTORS           2       // Just below the state log, written in turn
+#define STATS_OFFSET            (STATE_OFFSET - STATS_SECTORS * FLASH_SECTOR_SIZE)
+#define STATS_MAGIC             0x4A4B5331 // "JKS1"
+#define STATS_PLAYS_BITS        6
+#define STATS_SKIPS_BITS        5
+#define STATS_COMPLETIONS_BITS  5
+
+/**
+ * @brief Notifications from the player engine
+ */
+#define NOTIFY_TRACK_COMPLETED  1
+#define NOTIFY_TRACK_MISSING    2
+#define NOTIFY_TRACK_ADVANCED   3
+#define NOTIFY_TRACK_ENDED      4
+
+/**
+ * @brief Flag added to a key event for a long press
+ */
+#define KEY_LONG_PRESS          0x80
+
+/**
+ * @brief Key events that are not keys: the volume ramp steps, the dialing timeout and the extra button
+ */
+// All are raised from interrupts, and the playlist state and the volume are
+// only touched by the main loop, so they go through the same queue as the keys.
+#define KEY_EVENT_VOLUME_DOWN   0x7C
+#define KEY_EVENT_VOLUME_UP     0x7D
+#define KEY_EVENT_INPUT_TIMEOUT 0x7E
+#define KEY_EVENT_BUTTON        0x7F
+
+/**
+ * @brief Trace events. The argument of each is noted alongside.
+ */
+#define TRACE_KEY               1       // Key index, with KEY_LONG_PRESS, or a KEY_EVENT_
+#define TRACE_QUEUED            2       // Player command
+#define TRACE_QUEUE_FULL        3       // Player command
+#define TRACE_TX                4       // Player command
+#define TRACE_RX                5       // Frame command
+#define TRACE_STATUS            6       // PLAYING or PAUSED_OR_IDLE
+#define TRACE_COMPLETED         7       // Track number
+#define TRACE_ADVANCED          8       // Track number
+#define TRACE_MISSING           9       // Track number
+#define TRACE_READY             10      // 0 if reported by the player, 1 on timeout
+#define TRACE_ERROR             11      // Error code
+#define TRACE_FILE_COUNT        12      // Number of files
+#define TRACE_GAP               13      // Silence between two tracks in milliseconds
+#define TRACE_IDLE              14      // 1 entering the low-power idle mode, 0 leaving it
+#define TRACE_WAKE              15      // Time from wake-up to the first command in 100us steps
+#define TRACE_PROFILE           16      // Index in PLAYER_PROFILES chosen by the probe
+#define TRACE_DRAIN_MAX         8       // Records printed per call to trace_drain()
+
+/**
+ * @brief Stages timed by the benchmark mode
+ */
+#define BENCH_DEBOUNCE          0       // Key detected to key event queued
+#define BENCH_DISPATCH          1       // Key event queued to handled by the main loop
+#define BENCH_QUEUE             2       // Key handled to player command queued
+#define BENCH_SEND              3       // Command queued to frame sent by core 1
+#define BENCH_KEY_TO_TX         4       // Key detected to frame sent
+#define BENCH_ACK               5       // Status query sent to reply received
+#define BENCH_END_TO_PLAY       6       // End of track to next PLAY frame sent
+#define BENCH_STAGES            7
+
+#if TRACE
+#define TRACE_EVENT(event, arg) trace(event, arg)
+#else
+#define TRACE_EVENT(event, arg)
+#endif
+
+/**
+ * @brief Priorities of the sounds played by the buzzer
+ */
+#define SOUND_BEEP              0       // Key feedback
+#define SOUND_FEEDBACK          1       // Setting changes
+#define SOUND_FANFARE           2       // Easter eggs
+
+/**
+ * @brief Battery profiles
+ */
+#define BATTERY_NORMAL          0
+#define BATTERY_SAVING          1
+#define BATTERY_CRITICAL        2
+
+#define FADE_STEPS              MAX(1, FADE_MS / player_profile->min_gap_ms) // Volume frames per fade
+
+/**
+ * @brief Remote protocol on the USB console. Frames are 5 bytes: REMOTE_SYNC, type,
+ * argument (high byte first) and a checksum that makes the sum of the last 4 bytes 0
+ */
+#define REMOTE_SYNC             0xA5    // Never part of the text of the trace
+#define REMOTE_FRAME_SIZE       5
+#define REMOTE_KEY              0x01    // KEY_ action in the high byte, its argument in the low byte
+#define REMOTE_PLAY             0x02    // Track number
+#define REMOTE_VOLUME           0x03    // Volume
+#define REMOTE_QUERY            0x04    // Send all the telemetry again
+#define TELEMETRY_TRACK         0x81    // Telemetry, sent when it changes: current track
+#define TELEMETRY_STATE         0x82    // TELEMETRY_ flags below
+#define TELEMETRY_VOLUME        0x83
+#define TELEMETRY_EQ            0x84
+#define TELEMETRY_BATTERY_MV    0x85
+#define TELEMETRY_RUNTIME_MIN   0x86    // Estimated battery runtime
+#define TELEMETRY_FIRST         TELEMETRY_TRACK
+#define TELEMETRY_FIELDS        6
+#define TELEMETRY_PLAYING       0x01
+#define TELEMETRY_PAUSED        0x02
+#define TELEMETRY_REPEAT        0x04
+#define TELEMETRY_SHUFFLE       0x08
+
+/**
+ * @brief Timers of core 0, all run by the scheduler from one hardware alarm
+ */
+#define TIMER_POWER_ON          0
+#define TIMER_BLINK             1
+#define TIMER_SOUND             2
+#define TIMER_INPUT             3
+#define TIMER_KEYPAD            4
+#define TIMER_VOLUME_RAMP       5
+#define TIMER_BATTERY           6
+#define TIMER_BENCHMARK         7
+#define TIMER_COUNT             8
+
+/**
+ * @brief Timer callback
+ * @return Microseconds until the next call, 0 to stop the timer
+ */
+typedef int64_t (*timer_callback_t)();
+
+/**
+ * @brief Deadline and callback of each timer. A zero deadline means the timer is stopped.
+ */
+static struct {
+    uint64_t deadline;
+    timer_callback_t callback;
+} timers[TIMER_COUNT];
+
+/**
+ * @brief Hardware alarm of the scheduler, and the deadline it is set to
+ */
+static uint8_t timer_alarm;
+static uint64_t timer_alarm_at = UINT64_MAX;
+
+/**
+ * @brief Flag to indicate if timer_service() is running the callbacks
+ */
+static bool timer_servicing;
 
 /**
  * @brief Current state of the player
  */
-uint8_t status = PAUSED_OR_IDLE;
+volatile uint8_t status = PAUSED_OR_IDLE;
 
 /**
  * @brief Flag to indicate if the player is paused
  */
-bool is_paused = false;
+volatile bool is_paused = false;
 
 /**
  * @brief Flag to indicate if repeat is enabled
@@ -59,9 +243,165 @@ bool repeat = false;
 uint16_t current_track = 1;
 
 /**
- * @brief Next player command to be executed
+ * @brief Number of tracks on the microSD card, as reported by the player
+ */
+volatile uint16_t num_tracks = NUM_TRACKS;
+
+/**
+ * @brief Bitmap of the tracks that failed to play
+ */
+static uint32_t tracks_missing[NUM_TRACKS / 32 + 1];
+
+#if TRACK_INDEX_IN_RAM
+/**
+ * @brief Genre of each track, as an index in GENRES plus one (0 if none)
+ */
+static uint8_t track_genres[NUM_TRACKS + 1];
+#endif
+
+/**
+ * @brief Track to play as soon as the current one ends. 0 to wait for core 0.
+ */
+// Computed ahead of time by arm_next_track() on core 0 and fired by the engine
+// on core 1, so that auto-advance does not wait for a round trip between the cores.
+static volatile uint16_t player_next_track;
+
+/**
+ * @brief Key action that selected the current track, to skip a missing one in the same direction
+ */
+static uint8_t track_source = KEY_NONE;
+
+/**
+ * @brief Flag to indicate if the next track comes from the shuffled playlist
+ */
+static bool shuffling;
+
+/**
+ * @brief Ring of the tracks played before the current one, newest last
+ */
+static uint16_t track_history[HISTORY_SIZE];
+static uint8_t track_history_head;
+static uint8_t track_history_count;
+
+/**
+ * @brief Tracks to play before moving on, from the front at upcoming_head
+ */
+// Dialed tracks are added at the tail. Going back through the history puts
+// the track being left at the front, so that "next" returns to it.
+static uint16_t upcoming[UPCOMING_SIZE];
+static uint8_t upcoming_head;
+static uint8_t upcoming_tail;
+
+/**
+ * @brief Current volume, tracked locally so that changes can be sent as one absolute write
+ */
+uint8_t volume = VOLUME_DEFAULT;
+
+/**
+ * @brief Key held down to ramp the volume, and the direction of the ramp (0 when not ramping)
+ */
+static uint8_t volume_ramp_key;
+static volatile int8_t volume_ramp_step;
+
+/**
+ * @brief Ring buffer of player commands, from core 0 to the player engine on core 1
+ */
+static uint8_t player_queue[PLAYER_QUEUE_SIZE];
+static volatile uint8_t player_queue_head; // Written by player_request() only
+static volatile uint8_t player_queue_tail; // Written by player_next_command() only
+
+/**
+ * @brief Flags of the commands currently waiting in the queue
+ */
+// One byte per command rather than a bitmask, because both cores write them
+static volatile bool player_queue_pending[FILE_COUNT + 1];
+
+/**
+ * @brief Ring buffer of notifications from the player engine to core 0
+ */
+// Not the multicore FIFO: flash_safe_execute() uses it for its lockout
+// handshake and would discard anything it finds there.
+static uint32_t player_notifications[PLAYER_EVENT_QUEUE_SIZE];
+static volatile uint8_t player_notifications_head; // Written by player_notify() only
+static volatile uint8_t player_notifications_tail; // Written by handle_player_notifications() only
+
+/**
+ * @brief Time the last frame was sent to the player, in microseconds
+ */
+static uint64_t player_last_tx;
+
+/**
+ * @brief Time the last PLAY frame was sent to the player, in microseconds
+ */
+static uint64_t player_last_play;
+
+/**
+ * @brief Track sent with the last PLAY frame
  */
-uint8_t next_player_command = STATUS;
+static uint16_t player_last_track;
+
+/**
+ * @brief Pre-armed track the engine is about to play, 0 if none
+ */
+static uint16_t player_advance_track;
+
+/**
+ * @brief Time the BUSY pin is due to be checked, in microseconds. 0 if no check is pending.
+ */
+// Also written by busy_irq_handler(). A 64-bit access takes two, so core 1
+// masks interrupts around each of its own.
+static volatile uint64_t busy_check_at;
+
+/**
+ * @brief Flag to indicate if the player has finished booting and accepts commands
+ */
+static bool player_ready;
+
+/**
+ * @brief Volume last sent to the player, which differs from volume during a fade
+ */
+static uint8_t player_volume;
+
+/**
+ * @brief Command held back until the fade out is over, or STATUS if none
+ */
+static uint8_t player_fade_command = STATUS;
+
+/**
+ * @brief Profile of the player, chosen by player_probe()
+ */
+// Until the probe is over, the most conservative profile is used
+static const struct player_profile_t *player_profile =
+    &PLAYER_PROFILES[PLAYER_PROFILE < 0 ? PROFILE_NO_STATUS : PLAYER_PROFILE];
+
+/**
+ * @brief Probe state: time the status query was sent (0 before that), the reply delay (0 before the reply),
+ * and the count of frames with a wrong checksum when the query was sent
+ */
+static bool player_probed = (PLAYER_PROFILE >= 0);
+static uint64_t player_probe_sent;
+static uint32_t player_probe_latency;
+static uint16_t player_probe_bad;
+
+/**
+ * @brief Frames received with a wrong checksum
+ */
+static volatile uint16_t player_rx_bad_checksum;
+
+/**
+ * @brief Frame received from the player
+ */
+typedef struct {
+    uint8_t cmd;
+    uint16_t arg;
+} player_event_t;
+
+/**
+ * @brief Ring buffer of frames received from the player, waiting to be handled by poll_player()
+ */
+static player_event_t player_events[PLAYER_EVENT_QUEUE_SIZE];
+static volatile uint8_t player_events_head; // Written by dfplayer_rx_handler() only
+static volatile uint8_t player_events_tail; // Written by poll_player() only
 
 /**
  * @brief Track ID prompt
@@ -73,21 +413,231 @@ uint16_t track_id_prompt;
  */
 uint16_t track_id_to_play;
 
+/**
+ * @brief Average interval between two digits, in milliseconds
+ */
+uint16_t dial_interval_ms = INPUT_TIMEOUT_MS / 2;
+
+/**
+ * @brief Time the last digit was typed, in milliseconds
+ */
+uint32_t dial_last_digit;
+
+/**
+ * @brief Last four digits typed, across track numbers
+ */
+uint16_t dial_recent;
+
 /**
  * @brief Current EQ preset
  */
 uint8_t eq;
 
 /**
- * @brief Shuffled playlist
+ * @brief Random number generator state (PCG32)
+ */
+typedef struct {
+    uint64_t state;
+    uint64_t inc;
+} pcg32_t;
+
+/**
+ * @brief Battery profile, lowered as the battery drains
+ */
+static volatile uint8_t battery_profile = BATTERY_NORMAL;
+
+/**
+ * @brief Battery voltage in millivolts, filtered. 0 before the first reading.
+ */
+static uint16_t battery_mv;
+
+/**
+ * @brief Estimated remaining runtime at the current load, in minutes
+ */
+static uint16_t battery_runtime_min;
+
+/**
+ * @brief Latest burst of ADC samples of the battery voltage, written by DMA
+ */
+static uint16_t battery_samples[BATTERY_BURST_SAMPLES];
+static int battery_dma;
+static volatile bool battery_burst_done;
+
+/**
+ * @brief Seed of the shuffled playlists
+ */
+uint64_t shuffle_seed;
+
+/**
+ * @brief Number of the current shuffled playlist. Together with the seed, it selects the permutation.
+ */
+uint32_t shuffle_epoch;
+
+/**
+ * @brief Flag to indicate if the shuffled playlist has been seeded
+ */
+bool shuffle_loaded;
+
+/**
+ * @brief Round keys of the permutation that defines the shuffled playlist
+ */
+uint32_t shuffle_keys[SHUFFLE_ROUNDS];
+
+/**
+ * @brief Width in bits of each half of the permutation input
+ */
+uint8_t shuffle_half_bits;
+
+/**
+ * @brief Genre the shuffled playlist is limited to, plus one. 0 for all tracks.
  */
-uint16_t shuffled_playlist[NUM_TRACKS+1];
+uint8_t shuffle_genre;
 
 /**
  * @brief Current playlist index
  */
 uint16_t playlist_index = 1;
 
+/**
+ * @brief Flag to indicate if the low-power idle mode is active
+ */
+static volatile bool power_idle;
+
+/**
+ * @brief Flag set by the wake-up sources to leave the low-power idle mode
+ */
+static volatile bool power_wake_requested;
+
+/**
+ * @brief System clock requested by core 0 in kHz, 0 once core 1 has applied it
+ */
+static volatile uint32_t power_clock_request;
+
+/**
+ * @brief Time of the last user or player activity, in milliseconds
+ */
+static volatile uint32_t power_last_activity;
+
+/**
+ * @brief Time the low-power idle mode was left, in microseconds. Cleared once the first command is sent.
+ */
+static volatile uint64_t power_wake_time;
+
+/**
+ * @brief Play statistics of a track. The counters saturate by halving all of them.
+ */
+typedef struct {
+    uint16_t plays : STATS_PLAYS_BITS;
+    uint16_t skips : STATS_SKIPS_BITS;             // Left before STATS_SKIP_MS
+    uint16_t completions : STATS_COMPLETIONS_BITS; // Played to the end
+} track_stats_t;
+
+/**
+ * @brief Play statistics, as saved to flash
+ */
+typedef struct {
+    uint32_t magic;
+    uint32_t sequence;          // Incremented by every save
+    track_stats_t tracks[NUM_TRACKS]; // Track 1 first
+    uint32_t checksum;
+} saved_stats_t;
+
+#define STATS_PAGES             ((sizeof(saved_stats_t) + FLASH_PAGE_SIZE - 1) / FLASH_PAGE_SIZE)
+
+/**
+ * @brief Play statistics, padded to whole flash pages
+ */
+static union {
+    saved_stats_t record;
+    uint8_t pages[STATS_PAGES * FLASH_PAGE_SIZE];
+} stats;
+
+/**
+ * @brief Sector of the last saved statistics
+ */
+static uint8_t stats_sector;
+
+/**
+ * @brief Flag to indicate if the statistics changed since they were saved, and time of the last save in milliseconds
+ */
+static bool stats_dirty;
+static uint32_t stats_saved_at;
+
+/**
+ * @brief Time the current track started, in milliseconds
+ */
+static uint32_t stats_started_at;
+
+#if WEIGHTED_SHUFFLE
+/**
+ * @brief Alias table of the weighted shuffle, over the tracks from weights_first
+ */
+// Vose's alias method: a pick takes one random number and one table lookup,
+// whatever the weights. Column i returns track i with probability
+// weights_prob[i] / 65536, and weights_alias[i] otherwise.
+static uint16_t weights_prob[NUM_TRACKS];
+static uint16_t weights_alias[NUM_TRACKS];
+static uint16_t weights_first;
+static uint16_t weights_length;
+
+/**
+ * @brief Flag to indicate if the statistics or the playlist changed since the alias table was built
+ */
+static bool weights_stale = true;
+
+/**
+ * @brief Random number generator of the weighted shuffle
+ */
+static pcg32_t weighted_rng;
+
+/**
+ * @brief Next track of the weighted shuffle, picked ahead for arm_next_track(). 0 if none.
+ */
+static uint16_t weighted_next;
+#endif
+
+/**
+ * @brief Playback state, as saved to flash
+ */
+typedef struct {
+    uint32_t magic;
+    uint32_t sequence;          // Incremented by every record
+    uint64_t shuffle_seed;      // 0 if the shuffled playlist was never used
+    uint32_t shuffle_epoch;
+    uint16_t current_track;
+    uint16_t playlist_index;
+    uint8_t volume;
+    uint8_t eq;
+    uint8_t repeat;
+    uint8_t shuffle_genre;
+    uint32_t checksum;
+} saved_state_t;
+
+#define STATE_SLOTS             (FLASH_SECTOR_SIZE / sizeof(saved_state_t)) // Per sector
+
+/**
+ * @brief Last state written to or read from flash
+ */
+static saved_state_t saved_state;
+
+/**
+ * @brief Position of the last record in the state log
+ */
+static uint8_t state_sector;
+static uint16_t state_slot;
+
+/**
+ * @brief Time the state last changed without being saved, in milliseconds
+ */
+static uint32_t state_changed_at;
+
+/**
+ * @brief Ring buffer of key events waiting to be handled by the main loop
+ */
+static uint8_t key_events[KEY_EVENT_QUEUE_SIZE];
+static volatile uint8_t key_events_head; // Written by key_event_push() only
+static volatile uint8_t key_events_tail; // Written by the main loop only
+
 /**
  * @brief Keypad matrix
  */
@@ -104,66 +654,622 @@ const uint8_t cols[] = KEYPAD_COLS;
 const uint8_t rows[] = KEYPAD_ROWS;
 
 /**
- * @brief DFPlayer instance
+ * @brief Bitmask of the keys inside their debounce window
  */
-dfplayer_t dfplayer;
+static uint32_t keys_bouncing;
 
 /**
- * @brief Tone generator instance
+ * @brief Time of the last accepted press of each key, in microseconds
  */
-struct tonegenerator_t generator; // Used to drive the built-in piezo element
+static uint32_t key_last_press[sizeof(cols) * sizeof(rows)];
 
 /**
- * @brief Power-on complete callback
- * @return 0
+ * @brief Track current before the last key press was handled
  */
-int64_t power_on_complete(){
-    gpio_put(POWER_ON_LED_PIN, 0);
-    return 0;
-}
+// A long press is reported once its short action has already run, so the
+// genre actions refer to the track that was playing when the key went down.
+static uint16_t key_press_track = 1;
 
 /**
- * @brief Blink complete callback
- * @return 0
+ * @brief What the last short press changed, for a long press to put back
  */
-int64_t blink_complete(){
-    gpio_put(LED_PIN, 0);
-    return 0;
-}
+// Keeps the slots that the history and the upcoming tracks may have
+// overwritten, and the play statistics of the track that was left.
+static struct {
+    uint16_t track;
+    uint32_t started_at;
+    track_stats_t stats;
+    uint8_t history_head;
+    uint8_t history_count;
+    uint16_t history_slot;
+    uint8_t upcoming_head;
+    uint8_t upcoming_tail;
+    uint16_t upcoming_slot;
+} key_press_undo;
 
 /**
- * @brief Blink the LED for a specified duration
- * @param ms Duration of the blink in milliseconds
+ * @brief DFPlayer instance
  */
-void blink(uint16_t ms){
-    gpio_put(LED_PIN, 1);
-    if (blink_alarm) cancel_alarm(blink_alarm);
-    blink_alarm = add_alarm_in_ms(ms, blink_complete, NULL, true);
-}
+dfplayer_t dfplayer;
 
+#if TRACE
 /**
- * @brief Randomize the playlist
+ * @brief Trace record
  */
-void randomize_playlist(){
-    uint16_t i = NUM_TRACKS;
-    uint16_t r1, r2, temp;
+typedef struct {
+    uint32_t time_us;
+    uint8_t event;
+    uint8_t reserved;
+    uint16_t arg;
+} trace_t;
 
-    for (i = 0; i <= NUM_TRACKS; i++){
-        shuffled_playlist[i] = i;
-    }
-
-    for (i = 0; i < NUM_TRACKS*2; i++){
-        r1 = rand() % NUM_TRACKS + 1;
-        r2 = rand() % NUM_TRACKS + 1;
-
-        temp = shuffled_playlist[r1];
-        shuffled_playlist[r1] = shuffled_playlist[r2];
-        shuffled_playlist[r2] = temp;
-    }
-}
+/**
+ * @brief Ring buffers of trace records, one per core so that recording never waits for the other core
+ */
+static trace_t trace_ring[2][TRACE_BUFFER_SIZE];
+static volatile uint16_t trace_head[2]; // Written by trace() only
+static volatile uint16_t trace_tail[2]; // Written by trace_drain() only
 
 /**
- * @brief Toggle repeat mode
+ * @brief Records lost because a trace ring was full
+ */
+static volatile uint16_t trace_dropped[2];
+
+/**
+ * @brief Names of the trace events, as printed by trace_drain()
+ */
+static const char *const trace_names[] = {
+    [TRACE_KEY]         = "key",
+    [TRACE_QUEUED]      = "queued",
+    [TRACE_QUEUE_FULL]  = "queue_full",
+    [TRACE_TX]          = "tx",
+    [TRACE_RX]          = "rx",
+    [TRACE_STATUS]      = "status",
+    [TRACE_COMPLETED]   = "completed",
+    [TRACE_ADVANCED]    = "advanced",
+    [TRACE_MISSING]     = "missing",
+    [TRACE_READY]       = "ready",
+    [TRACE_ERROR]       = "error",
+    [TRACE_FILE_COUNT]  = "file_count",
+    [TRACE_GAP]         = "gap_ms",
+    [TRACE_IDLE]        = "idle",
+    [TRACE_WAKE]        = "wake_100us",
+    [TRACE_PROFILE]     = "profile",
+};
+#endif
+
+#if BENCHMARK
+/**
+ * @brief Latest samples of each benchmark stage, in microseconds
+ */
+static uint32_t bench_samples[BENCH_STAGES][BENCHMARK_SAMPLES];
+static uint16_t bench_count[BENCH_STAGES];
+
+/**
+ * @brief Start time of the stages of the synthetic event in flight, in microseconds
+ */
+static volatile uint32_t bench_key_at;      // 0 when no synthetic key is in flight
+static volatile uint32_t bench_stage_at;
+static volatile uint32_t bench_end_at;      // 0 when no synthetic track end is in flight
+static volatile uint32_t bench_status_at;   // 0 when no status query is in flight
+
+/**
+ * @brief Flag asking core 1 to simulate the end of the current track
+ */
+static volatile bool bench_end_requested;
+
+/**
+ * @brief Names of the benchmark stages
+ */
+static const char *const bench_names[] = {
+    [BENCH_DEBOUNCE]    = "debounce",
+    [BENCH_DISPATCH]    = "dispatch",
+    [BENCH_QUEUE]       = "queue",
+    [BENCH_SEND]        = "send",
+    [BENCH_KEY_TO_TX]   = "key_to_tx",
+    [BENCH_ACK]         = "ack",
+    [BENCH_END_TO_PLAY] = "end_to_play",
+};
+
+#endif
+
+#if TRACE
+/**
+ * @brief Time the end of the last track was detected, in microseconds. 0 when not measuring.
+ */
+static uint64_t player_track_ended_at;
+#endif
+
+/**
+ * @brief Sound played by the buzzer
+ */
+typedef struct {
+    const struct note_t *notes; // NULL for a single tone
+    uint16_t freq;              // Single tone only
+    uint16_t duration_ms;       // Single tone only
+    uint8_t priority;
+} sound_t;
+
+/**
+ * @brief Ring buffer of melodies waiting to be played
+ */
+static sound_t sound_queue[SOUND_QUEUE_SIZE];
+static uint8_t sound_queue_head;
+static uint8_t sound_queue_tail;
+
+/**
+ * @brief Sound being played, and position of its next note
+ */
+static sound_t sound_current;
+static uint16_t sound_note;
+static bool sound_playing;
+
+/**
+ * @brief Silence left before the next note, in microseconds
+ */
+static uint32_t sound_rest_us;
+
+#if TRACE
+/**
+ * @brief Record a trace event
+ * @param event One of the TRACE_ events
+ * @param arg Event argument
+ */
+// Safe to call from any context on either core: each core has its own ring,
+// and interrupts are masked while the record is written.
+void __not_in_flash_func(trace)(uint8_t event, uint16_t arg){
+    uint8_t core = get_core_num();
+    uint32_t irq_status = save_and_disable_interrupts();
+    uint16_t head = trace_head[core];
+    if((uint16_t)(head - trace_tail[core]) < TRACE_BUFFER_SIZE){
+        trace_t *record = &trace_ring[core][head & (TRACE_BUFFER_SIZE - 1)];
+        record->time_us = time_us_32();
+        record->event = event;
+        record->arg = arg;
+        __dmb();
+        trace_head[core] = head + 1;
+    } else {
+        trace_dropped[core]++;
+    }
+    restore_interrupts(irq_status);
+}
+
+/**
+ * @brief Print the pending trace records on the USB console. Called by the main loop.
+ */
+// Each line is "T <time_us> <core> <event> <arg>", easy to parse on the host.
+// Nothing is printed while no host is connected: records then wait in the rings,
+// or are counted as dropped once the rings are full.
+void trace_drain(){
+    if(!stdio_usb_connected()){ return; }
+    for(uint8_t core = 0; core < 2; core++){
+        for(uint8_t n = 0; n < TRACE_DRAIN_MAX && trace_tail[core] != trace_head[core]; n++){
+            uint16_t tail = trace_tail[core];
+            __dmb();
+            trace_t record = trace_ring[core][tail & (TRACE_BUFFER_SIZE - 1)];
+            trace_tail[core] = tail + 1;
+            printf("T %u %u %s %u\n", (unsigned int)record.time_us, core,
+                trace_names[record.event], record.arg);
+        }
+        if(trace_dropped[core]){
+            printf("T %u %u dropped %u\n", (unsigned int)time_us_32(), core, trace_dropped[core]);
+            trace_dropped[core] = 0;
+        }
+    }
+}
+#endif
+
+#if BENCHMARK
+/**
+ * @brief Record a benchmark sample
+ * @param stage One of the BENCH_ stages
+ * @param since Start time of the stage in microseconds
+ * @return End time of the stage, which is the start of the next one
+ */
+// Each stage is only recorded by one core, so the arrays need no locking.
+uint32_t bench_record(uint8_t stage, uint32_t since){
+    uint32_t now = time_us_32();
+    bench_samples[stage][bench_count[stage] % BENCHMARK_SAMPLES] = now - since;
+    bench_count[stage]++;
+    return now;
+}
+#endif
+
+/**
+ * @brief Run the timers that are due and set the hardware alarm to the next deadline
+ */
+// Callbacks run in the alarm interrupt, as they did with the SDK alarms.
+// A callback that returns a delay is re-armed from its own deadline, so
+// that periodic timers do not drift.
+void __not_in_flash_func(timer_service)(){
+    timer_servicing = true;
+    while(true){
+        uint64_t now = time_us_64();
+        for(uint8_t i = 0; i < TIMER_COUNT; i++){
+            uint64_t deadline = timers[i].deadline;
+            if(!deadline || deadline > now){ continue; }
+            timers[i].deadline = 0;
+            int64_t delay = timers[i].callback();
+            if(delay > 0 && !timers[i].deadline){
+                timers[i].deadline = MAX(deadline + delay, now + 1);
+            }
+        }
+        // Callbacks may have armed other timers
+        uint64_t next = UINT64_MAX;
+        for(uint8_t i = 0; i < TIMER_COUNT; i++){
+            if(timers[i].deadline && timers[i].deadline < next){ next = timers[i].deadline; }
+        }
+        timer_alarm_at = next;
+        if(next == UINT64_MAX){
+            hardware_alarm_cancel(timer_alarm);
+            break;
+        }
+        // Returns true when the deadline has already passed
+        if(!hardware_alarm_set_target(timer_alarm, from_us_since_boot(next))){ break; }
+    }
+    timer_servicing = false;
+}
+
+/**
+ * @brief Hardware alarm interrupt handler of the scheduler
+ * @param alarm Hardware alarm number
+ */
+void __not_in_flash_func(timer_irq_handler)(uint alarm){
+    timer_alarm_at = UINT64_MAX;
+    timer_service();
+}
+
+/**
+ * @brief Start or restart a timer
+ * @param timer One of the TIMER_ timers
+ * @param callback Function to call when the timer expires
+ * @param delay_us Delay in microseconds
+ */
+// Re-arming only writes the timer slot; the hardware alarm is moved
+// when the new deadline is the earliest one. Timers armed from a callback
+// are picked up by timer_service() once the callbacks have run.
+void timer_arm(uint8_t timer, timer_callback_t callback, uint64_t delay_us){
+    uint32_t irq_status = save_and_disable_interrupts();
+    uint64_t deadline = time_us_64() + delay_us;
+    timers[timer].callback = callback;
+    timers[timer].deadline = deadline;
+    if(!timer_servicing && deadline < timer_alarm_at){
+        timer_alarm_at = deadline;
+        if(hardware_alarm_set_target(timer_alarm, from_us_since_boot(deadline))){ timer_service(); }
+    }
+    restore_interrupts(irq_status);
+}
+
+/**
+ * @brief Stop a timer
+ * @param timer One of the TIMER_ timers
+ */
+// The hardware alarm is left as it is: if the timer was the next one due,
+// the alarm fires with nothing to run and moves on to the next deadline.
+void timer_cancel(uint8_t timer){
+    // The 64-bit store takes two writes, the scheduler must not see half of it
+    uint32_t irq_status = save_and_disable_interrupts();
+    timers[timer].deadline = 0;
+    restore_interrupts(irq_status);
+}
+
+/**
+ * @brief Check whether a timer is running
+ * @param timer One of the TIMER_ timers
+ * @return True if the timer is armed
+ */
+bool timer_armed(uint8_t timer){
+    return timers[timer].deadline != 0;
+}
+
+/**
+ * @brief Set up the scheduler
+ */
+void timer_init(){
+    timer_alarm = hardware_alarm_claim_unused(true);
+    hardware_alarm_set_callback(timer_alarm, timer_irq_handler);
+}
+
+/**
+ * @brief Power-on complete callback
+ * @return 0
+ */
+int64_t power_on_complete(){
+    gpio_put(POWER_ON_LED_PIN, 0);
+    return 0;
+}
+
+/**
+ * @brief Turn the feedback LED on or off
+ * @param on True to turn it on
+ */
+// The LED is driven by PWM, so that it can be dimmed in the power-saving profile
+void led_set(bool on){
+    uint8_t level = battery_profile == BATTERY_NORMAL ? 255 : LED_SAVING_LEVEL;
+    pwm_set_gpio_level(LED_PIN, on ? level : 0);
+}
+
+/**
+ * @brief Blink complete callback
+ * @return 0
+ */
+int64_t blink_complete(){
+    led_set(false);
+    return 0;
+}
+
+/**
+ * @brief Blink the LED for a specified duration
+ * @param ms Duration of the blink in milliseconds
+ */
+void blink(uint16_t ms){
+    led_set(true);
+    timer_arm(TIMER_BLINK, blink_complete, ms * 1000);
+}
+
+/**
+ * @brief Set the buzzer frequency
+ * @param freq Frequency in Hz, 0 for silence
+ */
+// The divider is recomputed for every note, as the system clock changes
+// in the low-power idle mode.
+void buzzer_set(uint16_t freq){
+    uint slice = pwm_gpio_to_slice_num(BUZZER_PIN);
+    if(!freq){
+        pwm_set_gpio_level(BUZZER_PIN, 0);
+        pwm_set_enabled(slice, false);
+        return;
+    }
+    uint32_t sys_hz = clock_get_hz(clk_sys);
+    // Divider in 1/16ths, large enough to keep the wrap below 65536
+    uint32_t div16 = sys_hz / ((uint32_t)freq * 4096) + 1;
+    if(div16 < 16){ div16 = 16; }
+    uint32_t wrap = (uint64_t)sys_hz * 16 / ((uint64_t)div16 * freq) - 1;
+    pwm_set_clkdiv_int_frac(slice, div16 >> 4, div16 & 0xF);
+    pwm_set_wrap(slice, wrap);
+    pwm_set_gpio_level(BUZZER_PIN, wrap / 2);
+    pwm_set_enabled(slice, true);
+}
+
+/**
+ * @brief Start the next note, or the next sound in the queue
+ * @return Time until the next step in microseconds, 0 when there is nothing left to play
+ */
+// A note sounds for 90% of its length, followed by a short rest, so that
+// repeated notes can be told apart.
+int64_t sound_step(){
+    if(sound_rest_us){
+        uint32_t rest = sound_rest_us;
+        sound_rest_us = 0;
+        buzzer_set(0);
+        return rest;
+    }
+    while(true){
+        if(!sound_playing){
+            if(sound_queue_tail == sound_queue_head){
+                buzzer_set(0);
+                return 0;
+            }
+            sound_current = sound_queue[sound_queue_tail & (SOUND_QUEUE_SIZE - 1)];
+            sound_queue_tail++;
+            sound_note = 0;
+            sound_playing = true;
+        }
+        if(!sound_current.notes){
+            if(sound_note++){ sound_playing = false; continue; }
+            buzzer_set(sound_current.freq);
+            return sound_current.duration_ms * 1000;
+        }
+        const struct note_t *note = &sound_current.notes[sound_note++];
+        if(note->freq == MELODY_END || note->measure == 0){ sound_playing = false; continue; }
+        // A negative measure is a dotted note
+        uint32_t duration_us = 60000000 / MELODY_TEMPO * 4 / abs(note->measure);
+        if(note->measure < 0){ duration_us += duration_us / 2; }
+        buzzer_set(note->freq == REST ? 0 : note->freq);
+        sound_rest_us = duration_us / 10;
+        return duration_us - sound_rest_us;
+    }
+}
+
+/**
+ * @brief Play a sound, pre-empting or queueing behind the one being played
+ * @param sound Sound to play
+ */
+// A sound pre-empts one of lower priority. A beep also replaces another beep,
+// so fast typing gives one clean beep per key; but it is dropped during a
+// melody, which is feedback in itself. A melody of the same or lower priority
+// waits for its turn.
+void sound_play(sound_t sound){
+    uint32_t irq_status = save_and_disable_interrupts(); // The sequencer runs in the timer interrupt
+    bool preempt = !sound_playing || sound.priority > sound_current.priority
+        || (sound.priority == sound_current.priority && !sound.notes && !sound_current.notes);
+    int64_t next = 0;
+    if(preempt){
+        timer_cancel(TIMER_SOUND);
+        sound_current = sound;
+        sound_note = 0;
+        sound_playing = true;
+        sound_rest_us = 0;
+        next = sound_step();
+    } else if(sound.notes && (uint8_t)(sound_queue_head - sound_queue_tail) < SOUND_QUEUE_SIZE){
+        sound_queue[sound_queue_head & (SOUND_QUEUE_SIZE - 1)] = sound;
+        sound_queue_head++;
+    }
+    if(next){ timer_arm(TIMER_SOUND, sound_step, next); }
+    restore_interrupts(irq_status);
+}
+
+/**
+ * @brief Beep the buzzer
+ * @param freq Frequency in Hz
+ * @param ms Duration in milliseconds
+ */
+void beep(uint16_t freq, uint16_t ms){
+    sound_play((sound_t){.freq = freq, .duration_ms = ms, .priority = SOUND_BEEP});
+}
+
+/**
+ * @brief Play a melody on the buzzer
+ * @param notes Notes, ending with MELODY_END
+ * @param priority One of the SOUND_ priorities
+ */
+void play_melody(const struct note_t *notes, uint8_t priority){
+    sound_play((sound_t){.notes = notes, .priority = priority});
+}
+
+/**
+ * @brief Next random number
+ * @param rng Generator state
+ * @return 32 random bits
+ */
+uint32_t pcg32_next(pcg32_t *rng){
+    uint64_t old = rng->state;
+    rng->state = old * 6364136223846793005ULL + rng->inc;
+    uint32_t xorshifted = ((old >> 18u) ^ old) >> 27u;
+    uint32_t rot = old >> 59u;
+    return (xorshifted >> rot) | (xorshifted << ((-rot) & 31));
+}
+
+/**
+ * @brief Seed a random number generator
+ * @param rng Generator state
+ * @param seed Initial state
+ * @param stream Sequence selector. Different streams give unrelated sequences for the same seed.
+ */
+void pcg32_seed(pcg32_t *rng, uint64_t seed, uint64_t stream){
+    rng->state = 0;
+    rng->inc = (stream << 1u) | 1u;
+    pcg32_next(rng);
+    rng->state += seed;
+    pcg32_next(rng);
+}
+
+/**
+ * @brief Genre of a track
+ * @param track Track number
+ * @return Index in GENRES, or -1 if the track is not in any genre
+ */
+int8_t genre_of(uint16_t track){
+    #if TRACK_INDEX_IN_RAM
+    return track <= NUM_TRACKS ? (int8_t)track_genres[track] - 1 : -1;
+    #else
+    for(uint8_t i = 0; i < NUM_GENRES; i++){
+        if(track >= GENRES[i].first && track <= GENRES[i].last){ return i; }
+    }
+    return -1;
+    #endif
+}
+
+#if TRACK_INDEX_IN_RAM
+/**
+ * @brief Build the table of the genre of each track
+ */
+void track_index_init(){
+    for(uint8_t i = 0; i < NUM_GENRES; i++){
+        for(uint16_t track = GENRES[i].first; track <= MIN(GENRES[i].last, NUM_TRACKS); track++){
+            track_genres[track] = i + 1;
+        }
+    }
+}
+#endif
+
+/**
+ * @brief First track of the shuffled playlist
+ */
+uint16_t playlist_first(){
+    return shuffle_genre ? GENRES[shuffle_genre - 1].first : 1;
+}
+
+/**
+ * @brief Number of tracks in the shuffled playlist
+ */
+// Clipped to the tracks on the card, so that a pass over the playlist does
+// not walk through positions that all land on missing tracks.
+uint16_t playlist_length(){
+    uint16_t first = playlist_first();
+    uint16_t last = MIN(shuffle_genre ? GENRES[shuffle_genre - 1].last : NUM_TRACKS, num_tracks);
+    return last >= first ? last - first + 1 : 0;
+}
+
+/**
+ * @brief Load the permutation of the current shuffled playlist
+ */
+// The keys only depend on shuffle_seed and shuffle_epoch, so any playlist
+// can be replayed from those two values and the playlist index.
+void load_playlist(){
+    pcg32_t rng;
+    pcg32_seed(&rng, shuffle_seed, shuffle_epoch);
+    shuffle_half_bits = 1;
+    while((1u << (shuffle_half_bits * 2)) < playlist_length()){ shuffle_half_bits++; }
+    for(uint8_t i = 0; i < SHUFFLE_ROUNDS; i++){
+        shuffle_keys[i] = pcg32_next(&rng);
+    }
+    #if WEIGHTED_SHUFFLE
+    weighted_rng = rng;
+    #endif
+    #if DEBUG
+    printf("shuffle seed: 0x%08x%08x\tepoch: %u\n", (unsigned int)(shuffle_seed >> 32),
+        (unsigned int)shuffle_seed, (unsigned int)shuffle_epoch);
+    #endif
+}
+
+/**
+ * @brief Randomize the playlist
+ */
+// The shuffled playlist is not stored: the next epoch selects a
+// different permutation of the tracks, see shuffled_track().
+void randomize_playlist(){
+    shuffle_epoch++;
+    load_playlist();
+}
+
+/**
+ * @brief Reshuffle the playlist when the number of tracks changes. Called by the main loop.
+ */
+// num_tracks is set by core 1 from the file count of the player: the
+// permutation loaded for the previous count does not cover the new range.
+void playlist_update(){
+    static uint16_t playlist_num_tracks = NUM_TRACKS;
+    if(playlist_num_tracks == num_tracks){ return; }
+    playlist_num_tracks = num_tracks;
+    if(!shuffle_loaded){ return; }
+    randomize_playlist();
+    playlist_index = 1;
+    #if WEIGHTED_SHUFFLE
+    weighted_next = 0;
+    #endif
+}
+
+/**
+ * @brief Track at a given position of the shuffled playlist
+ * @param index Playlist position, 1 to playlist_length()
+ * @return Track number
+ */
+// A balanced Feistel network is a bijection over 2^(2*shuffle_half_bits)
+// values for any round function. Outputs beyond the playlist are fed back
+// in until they land inside it (cycle walking), which keeps the mapping a
+// bijection over the playlist; it takes about one extra pass on average.
+uint16_t shuffled_track(uint16_t index){
+    uint16_t length = playlist_length();
+    uint32_t mask = (1u << shuffle_half_bits) - 1;
+    uint32_t x = index - 1;
+    do {
+        uint32_t left = x >> shuffle_half_bits;
+        uint32_t right = x & mask;
+        for(uint8_t i = 0; i < SHUFFLE_ROUNDS; i++){
+            uint32_t f = (right ^ shuffle_keys[i]) * 0x9E3779B1u;
+            f ^= f >> 15;
+            uint32_t next = left ^ (f & mask);
+            left = right;
+            right = next;
+        }
+        x = (left << shuffle_half_bits) | right;
+    } while(x >= length);
+    return playlist_first() + x;
+}
+
+/**
+ * @brief Toggle repeat mode
  */
 void toggle_repeat(){
     repeat = !repeat;
@@ -171,350 +1277,1996 @@ void toggle_repeat(){
     printf("toggle_repeat: %d\n", repeat);
     #endif
     if(repeat){
-        melody(&generator, POSITIVE, 0);
+        play_melody(POSITIVE, SOUND_FEEDBACK);
     } else {
-        melody(&generator, NEGATIVE, 0);
+        play_melody(NEGATIVE, SOUND_FEEDBACK);
+    }
+}
+
+/**
+ * @brief Queue a command for the player engine on core 1
+ * @param command Player command
+ */
+// PLAY, VOLUME and EQ read current_track, volume and eq when they are sent,
+// so a request for one of them that is already waiting in the queue is dropped:
+// the pending entry will carry the latest value. PAUSE and RESUME are always
+// queued, as their order matters.
+void __not_in_flash_func(player_request)(uint8_t command){
+    if(command == PLAY){ is_paused = false; } // Playing a track cancels the pause
+    uint32_t irq_status = save_and_disable_interrupts(); // Requests come from several callbacks
+    bool coalesce = (command == PLAY || command == VOLUME || command == EQ);
+    // The value to send has been written by the caller before this check,
+    // see player_next_command() for the other half
+    __dmb();
+    if(coalesce && player_queue_pending[command]){
+        restore_interrupts(irq_status);
+        return;
+    }
+    uint8_t head = player_queue_head;
+    if((uint8_t)(head - player_queue_tail) >= PLAYER_QUEUE_SIZE){
+        restore_interrupts(irq_status);
+        TRACE_EVENT(TRACE_QUEUE_FULL, command);
+        return;
+    }
+    player_queue[head & (PLAYER_QUEUE_SIZE - 1)] = command;
+    if(coalesce){ player_queue_pending[command] = true; }
+    __dmb();
+    player_queue_head = head + 1;
+    restore_interrupts(irq_status);
+    TRACE_EVENT(TRACE_QUEUED, command);
+    #if BENCHMARK
+    if(bench_key_at && command == VOLUME){ bench_stage_at = bench_record(BENCH_QUEUE, bench_stage_at); }
+    #endif
+    __sev(); // Wake up core 1
+}
+
+/**
+ * @brief Volume up
+ */
+// The volume is sent as one absolute value: the pending VOLUME command reads
+// it when it goes out, so several steps in a row cost a single frame.
+// Also called by the volume ramp from the timer interrupt, so nothing is printed here.
+void volume_up(){
+    if(volume < MIN(VOLUME_MAX, VOLUME_CEILING)){ volume++; }
+    player_request(VOLUME);
+}
+
+/**
+ * @brief Volume down
+ */
+void volume_down(){
+    if(volume > VOLUME_MIN){ volume--; }
+    player_request(VOLUME);
+}
+
+/**
+ * @brief Next EQ preset
+ */
+void next_eq_preset(){
+    eq++;
+    if(eq > 5){ eq = 0; }
+    player_request(EQ);
+    #if DEBUG
+    printf("next_eq_preset: %d\n", eq);
+    #endif
+}
+
+/**
+ * @brief Toggle pause mode
+ */
+void toggle_pause(){
+    // The flag is set first: the engine checks it before auto-advancing
+    if(is_paused){
+        is_paused = false;
+        player_request(RESUME);
+    } else { 
+        is_paused = true;
+        player_request(PAUSE);
+    }
+    #if DEBUG
+    printf("Toggle pause: %d\tstatus:%d\n", is_paused, status);
+    #endif
+}
+
+/**
+ * @brief First track that is on the microSD card, starting from a given one
+ * @param track Track number to start from
+ * @param step Direction of the search: 1 or -1, or 0 to only check the given track
+ * @return Track number, or 0 if there is none
+ */
+uint16_t available_track(uint16_t track, int8_t step){
+    while(track >= 1 && track <= num_tracks){
+        if(!(tracks_missing[track / 32] & (1u << (track % 32)))){ return track; }
+        if(!step){ break; }
+        track += step;
+    }
+    return 0;
+}
+
+/**
+ * @brief Halve all the play statistics, once one of the counters is full
+ */
+// Keeps the proportions between the tracks, and lets old habits fade.
+void stats_halve(){
+    for(uint16_t i = 0; i < NUM_TRACKS; i++){
+        stats.record.tracks[i].plays >>= 1;
+        stats.record.tracks[i].skips >>= 1;
+        stats.record.tracks[i].completions >>= 1;
     }
 }
 
 /**
- * @brief Set a command as the next in line to be executed by the repeating timer
+ * @brief Mark the play statistics as changed
+ */
+void stats_changed(){
+    stats_dirty = true;
+    #if WEIGHTED_SHUFFLE
+    weights_stale = true;
+    #endif
+}
+
+/**
+ * @brief Count a track that starts playing
+ * @param track Track number
+ */
+void stats_started(uint16_t track){
+    stats_started_at = to_ms_since_boot(get_absolute_time());
+    if(track < 1 || track > NUM_TRACKS){ return; }
+    if(stats.record.tracks[track - 1].plays == (1u << STATS_PLAYS_BITS) - 1){ stats_halve(); }
+    stats.record.tracks[track - 1].plays++;
+    stats_changed();
+}
+
+/**
+ * @brief Count a track played to the end
+ * @param track Track number
+ */
+void stats_completed(uint16_t track){
+    if(track < 1 || track > NUM_TRACKS){ return; }
+    if(stats.record.tracks[track - 1].completions == (1u << STATS_COMPLETIONS_BITS) - 1){ stats_halve(); }
+    stats.record.tracks[track - 1].completions++;
+    stats_changed();
+}
+
+/**
+ * @brief Count a track left for another one, as a skip if it had only just started
+ * @param track Track number
+ */
+void stats_interrupted(uint16_t track){
+    if(track < 1 || track > NUM_TRACKS || status != PLAYING){ return; }
+    if(to_ms_since_boot(get_absolute_time()) - stats_started_at >= STATS_SKIP_MS){ return; }
+    if(stats.record.tracks[track - 1].skips == (1u << STATS_SKIPS_BITS) - 1){ stats_halve(); }
+    stats.record.tracks[track - 1].skips++;
+    stats_changed();
+}
+
+/**
+ * @brief Remember a track in the history
+ * @param track Track number
+ */
+void history_push(uint16_t track){
+    if(!available_track(track, 0)){ return; } // Skipped, never played
+    track_history[track_history_head++ & (HISTORY_SIZE - 1)] = track;
+    if(track_history_count < HISTORY_SIZE){ track_history_count++; }
+}
+
+/**
+ * @brief Take the latest track from the history
+ * @return Track number, or 0 if the history is empty
+ */
+uint16_t history_pop(){
+    if(!track_history_count){ return 0; }
+    track_history_count--;
+    return track_history[--track_history_head & (HISTORY_SIZE - 1)];
+}
+
+// The input timeout and the extra button reach the upcoming tracks through
+// the key event queue, so the queue is only touched by the main loop.
+/**
+ * @brief Add a track at the end of the upcoming tracks
+ * @param track Track number
+ * @return True if there was room for it
+ */
+bool upcoming_add(uint16_t track){
+    bool added = (uint8_t)(upcoming_tail - upcoming_head) < UPCOMING_SIZE;
+    if(added){ upcoming[upcoming_tail++ & (UPCOMING_SIZE - 1)] = track; }
+    return added;
+}
+
+/**
+ * @brief Put a track in front of the upcoming tracks, dropping the last one if full
+ * @param track Track number
+ */
+void upcoming_push_front(uint16_t track){
+    if((uint8_t)(upcoming_tail - upcoming_head) >= UPCOMING_SIZE){ upcoming_tail--; }
+    upcoming[--upcoming_head & (UPCOMING_SIZE - 1)] = track;
+}
+
+/**
+ * @brief First of the upcoming tracks
+ * @param pop True to remove it from the queue
+ * @return Track number, or 0 if there is none
+ */
+uint16_t upcoming_first(bool pop){
+    if(upcoming_tail == upcoming_head){ return 0; }
+    uint16_t track = upcoming[upcoming_head & (UPCOMING_SIZE - 1)];
+    if(pop){ upcoming_head++; }
+    return track;
+}
+
+/**
+ * @brief Move on to a track, remembering the current one in the history
+ * @param track Track number
+ * @param source Key action that selected the track
+ */
+void play_track(uint16_t track, uint8_t source){
+    if(track != current_track){
+        history_push(current_track);
+        stats_interrupted(current_track);
+    }
+    stats_started(track);
+    current_track = track;
+    track_source = source;
+    player_request(PLAY);
+}
+
+#if WEIGHTED_SHUFFLE
+/**
+ * @brief Weight of a track in the weighted shuffle
+ * @param track Track number
+ * @return Weight, 0 for a track that cannot be played
+ */
+uint32_t track_weight(uint16_t track){
+    if(!available_track(track, 0)){ return 0; }
+    const track_stats_t *track_stats = &stats.record.tracks[track - 1];
+    int32_t weight = WEIGHT_BASE + track_stats->completions * WEIGHT_COMPLETED - track_stats->skips * WEIGHT_SKIPPED;
+    return MAX(1, weight);
+}
+
+/**
+ * @brief Build the alias table of the weighted shuffle over the current playlist
+ */
+// Takes time linear in the number of tracks, so it is done by the main loop
+// and never when a track is picked. Weights are scaled so that their average
+// is the total weight: columns below it take their remainder from one above it.
+void weights_build(){
+    static uint32_t scaled[NUM_TRACKS];
+    static uint16_t work[NUM_TRACKS]; // Small columns from the start, large ones from the end
+    weights_first = playlist_first();
+    weights_length = playlist_length();
+    weights_stale = false;
+    uint32_t total = 0;
+    for(uint16_t i = 0; i < weights_length; i++){
+        uint32_t weight = track_weight(weights_first + i);
+        scaled[i] = weight * weights_length;
+        total += weight;
+    }
+    if(!total){
+        weights_length = 0;
+        return;
+    }
+    uint16_t small = 0, large = weights_length;
+    for(uint16_t i = 0; i < weights_length; i++){
+        if(scaled[i] < total){ work[small++] = i; } else { work[--large] = i; }
+    }
+    while(small > 0 && large < weights_length){
+        uint16_t less = work[--small];
+        uint16_t more = work[large++];
+        weights_prob[less] = ((uint64_t)scaled[less] << 16) / total;
+        weights_alias[less] = more;
+        scaled[more] -= total - scaled[less];
+        if(scaled[more] < total){ work[small++] = more; } else { work[--large] = more; }
+    }
+    // What is left is full, up to rounding
+    while(small > 0){ uint16_t i = work[--small]; weights_prob[i] = UINT16_MAX; weights_alias[i] = i; }
+    while(large < weights_length){ uint16_t i = work[large++]; weights_prob[i] = UINT16_MAX; weights_alias[i] = i; }
+}
+
+/**
+ * @brief Check whether a track was one of the latest played
+ * @param track Track number
+ * @return True if it is the current track or among the last WEIGHTED_NO_REPEAT of the history
+ */
+bool recently_played(uint16_t track){
+    if(track == current_track){ return true; }
+    for(uint8_t i = 1; i <= MIN(track_history_count, WEIGHTED_NO_REPEAT); i++){
+        if(track_history[(uint8_t)(track_history_head - i) & (HISTORY_SIZE - 1)] == track){ return true; }
+    }
+    return false;
+}
+
+/**
+ * @brief Pick a track of the playlist by its weight
+ * @return Track number, or 0 if there is none
+ */
+// A pick outside of the playlist comes from a table that has not been
+// rebuilt yet, after a genre change: it is drawn again.
+uint16_t weighted_pick(){
+    if(!weights_length){ return 0; }
+    uint16_t first = playlist_first();
+    for(uint8_t i = 0; i < WEIGHTED_TRIES; i++){
+        uint32_t random = pcg32_next(&weighted_rng);
+        uint16_t column = ((random >> 16) * weights_length) >> 16;
+        uint16_t track = weights_first + ((random & 0xFFFF) < weights_prob[column] ? column : weights_alias[column]);
+        if(track < first || track >= first + playlist_length() || !available_track(track, 0)){ continue; }
+        if(recently_played(track) && i < WEIGHTED_TRIES - 1){ continue; }
+        return track;
+    }
+    return 0;
+}
+#endif
+
+/**
+ * @brief Move along the shuffled playlist past a track returned by peek_random_track()
+ * @param index Playlist position of the track
+ */
+void shuffle_consume(uint16_t index){
+    #if WEIGHTED_SHUFFLE
+    (void)index;
+    weighted_next = 0;
+    #else
+    playlist_index = index + 1;
+    if(playlist_index > playlist_length()){
+        randomize_playlist();
+        playlist_index = 1;
+    }
+    #endif
+}
+
+/**
+ * @brief Next track of the shuffled playlist, without moving along the playlist
+ * @param index Set to the playlist position of the track
+ * @return Track number, or 0 if the playlist has to be randomized first
+ */
+uint16_t peek_random_track(uint16_t *index){
+    if(!shuffle_loaded){ return 0; }
+    #if WEIGHTED_SHUFFLE
+    // Picked once, then kept until random_track() or shuffle_consume() takes it
+    if(!weighted_next){ weighted_next = weighted_pick(); }
+    *index = 0;
+    return weighted_next;
+    #endif
+    for(uint16_t i = playlist_index; i <= playlist_length(); i++){
+        uint16_t track = shuffled_track(i);
+        if(available_track(track, 0)){
+            *index = i;
+            return track;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Play a random track
+ */
+void random_track(){
+    if(!shuffle_loaded){
+        // get_rand_64() draws its entropy from the ring oscillator,
+        // or from the TRNG on the RP2350
+        shuffle_seed = SHUFFLE_SEED ? SHUFFLE_SEED : get_rand_64();
+        load_playlist();
+        shuffle_loaded = true;
+    }
+    // Missing tracks are passed over without a round trip to the player
+    uint16_t track;
+    #if WEIGHTED_SHUFFLE
+    uint16_t index;
+    track = peek_random_track(&index);
+    weighted_next = 0;
+    if(!track){ return; }
+    #else
+    uint16_t tries = playlist_length();
+    if(!tries){ return; } // None of the genre is on the card
+    do {
+        track = shuffled_track(playlist_index);
+        playlist_index++;
+        if(playlist_index > playlist_length()){
+            randomize_playlist();
+            playlist_index = 1;
+        }
+    } while(!available_track(track, 0) && --tries);
+    if(!tries){ return; }
+    #endif
+
+    shuffling = SHUFFLE_AUTO_ADVANCE;
+    #if DEBUG
+    printf("random_track: %d\tepoch: %u\tplaylist_index:%d\n", track, (unsigned int)shuffle_epoch, playlist_index);
+    #endif
+    play_track(track, KEY_RANDOM);
+}
+
+// We could call dfplayer_previous() and dfplayer_next(), but some chips
+// in DFPlayer clones have trouble picking the right track when files have
+// not been transferred to the microSD card sequentially.
+/**
+ * @brief Previous track: the last one played, or the one before in order
+ */
+void prev_track(){
+    uint16_t track = history_pop();
+    if(track){
+        // Not pushed to the history: "next" comes back to this track instead
+        if(available_track(current_track, 0)){ upcoming_push_front(current_track); }
+        stats_interrupted(current_track);
+        stats_started(track);
+        current_track = track;
+        track_source = KEY_PREV;
+        player_request(PLAY);
+    } else {
+        track = available_track(current_track - 1, -1);
+        if(!track){ return; }
+        shuffling = false;
+        play_track(track, KEY_PREV);
+    }
+    #if DEBUG
+    printf("prev_track: %d\n", current_track);
+    #endif
+    // Cancel repeat
+    repeat = false;
+}
+
+/**
+ * @brief Next track: the first upcoming one, or the next of the shuffled playlist or in order
+ */
+void next_track(){
+    uint16_t track = upcoming_first(true);
+    if(track){
+        play_track(track, KEY_NEXT);
+    } else if(shuffling){
+        random_track();
+    } else {
+        track = available_track(current_track + 1, 1);
+        if(!track){ return; }
+        play_track(track, KEY_NEXT);
+    }
+    #if DEBUG
+    printf("next_track: %d\n", current_track);
+    #endif
+    // Cancel repeat
+    repeat = false;
+}
+
+/**
+ * @brief Jump to the first track of the previous genre
+ * @param from Track the jump starts from
+ */
+void prev_genre(uint16_t from){
+    int8_t genre = genre_of(from);
+    if(genre < 0){
+        // Between genres: go back to the nearest one
+        genre = NUM_GENRES;
+        while(genre > 0 && GENRES[genre - 1].first > from){ genre--; }
+    }
+    uint16_t track = genre > 0 ? available_track(GENRES[genre - 1].first, 1) : 0;
+    if(track){
+        shuffling = false;
+        play_track(track, KEY_NEXT);
+        #if DEBUG
+        printf("prev_genre: %d\ttrack: %d\n", genre - 1, current_track);
+        #endif
+        repeat = false;
+    }
+}
+
+/**
+ * @brief Jump to the first track of the next genre
+ * @param from Track the jump starts from
+ */
+void next_genre(uint16_t from){
+    for(uint8_t i = 0; i < NUM_GENRES; i++){
+        if(GENRES[i].first > from){
+            uint16_t track = available_track(GENRES[i].first, 1);
+            if(!track){ return; }
+            shuffling = false;
+            play_track(track, KEY_NEXT);
+            #if DEBUG
+            printf("next_genre: %d\ttrack: %d\n", i, current_track);
+            #endif
+            repeat = false;
+            return;
+        }
+    }
+}
+
+/**
+ * @brief Limit the shuffled playlist to the genre of a track, or lift the limit
+ * @param from Track whose genre is kept
+ */
+void toggle_genre_shuffle(uint16_t from){
+    if(shuffle_genre){
+        shuffle_genre = 0;
+    } else {
+        int8_t genre = genre_of(from);
+        if(genre < 0){ return; }
+        shuffle_genre = genre + 1;
+    }
+    #if DEBUG
+    printf("Genre shuffle: %d\n", shuffle_genre);
+    #endif
+    // Start a new playlist over the new set of tracks
+    if(shuffle_loaded){ randomize_playlist(); }
+    #if WEIGHTED_SHUFFLE
+    weights_stale = true;
+    weighted_next = 0;
+    #endif
+    playlist_index = 1;
+    random_track();
+}
+
+/**
+ * @brief Track completed: repeat it or move on to the next one
+ */
+void track_completed(){
+    if(is_paused){ return; }
+    stats_completed(current_track);
+    if(repeat){
+        stats_started(current_track);
+        player_request(PLAY);
+    } else {
+        next_track();
+    }
+}
+
+/**
+ * @brief Compute the track to play when the current one ends. Called by the main loop.
+ */
+// Whatever cannot be computed ahead of time (the end of the collection, or a
+// new shuffled playlist) is left to track_completed().
+void arm_next_track(){
+    uint16_t track;
+    uint16_t index;
+    uint16_t queued = upcoming_first(false);
+    if(repeat){
+        track = current_track;
+    } else if(queued){
+        // A missing one is left to track_completed() to skip
+        track = available_track(queued, 0);
+    } else if(shuffling){
+        track = peek_random_track(&index);
+    } else {
+        track = available_track(current_track + 1, 1);
+    }
+    player_next_track = track;
+}
+
+/**
+ * @brief The engine has started the pre-armed track
+ * @param track Track number
+ */
+// The track that ended has already been counted, see NOTIFY_TRACK_ENDED.
+void track_advanced(uint16_t track){
+    // A request queued in the meantime is about to replace the track
+    if(player_queue_pending[PLAY]){ return; }
+    stats_started(track);
+    if(track == current_track){ return; } // Repeated
+    uint16_t index;
+    if(upcoming_first(false) == track){
+        upcoming_first(true);
+        track_source = KEY_NEXT;
+    } else if(shuffling && peek_random_track(&index) == track){
+        shuffle_consume(index);
+        track_source = KEY_RANDOM;
+    } else {
+        track_source = KEY_NEXT;
+    }
+    history_push(current_track);
+    current_track = track;
+}
+
+/**
+ * @brief Track missing from the microSD card: remember it and skip it
+ * @param track Track number
+ */
+void track_missing(uint16_t track){
+    if(track < 1 || track > NUM_TRACKS){ return; }
+    tracks_missing[track / 32] |= 1u << (track % 32);
+    if(track != current_track){ return; } // Already moved on
+    switch(track_source){
+        case KEY_PREV:
+            prev_track();
+        break;
+        case KEY_NEXT:
+            next_track();
+        break;
+        case KEY_RANDOM:
+            random_track();
+        break;
+        default:
+            // Typed by number
+            play_melody(NEGATIVE, SOUND_FEEDBACK);
+    }
+}
+
+/**
+ * @brief Handle the notifications sent by the player engine. Called by the main loop.
+ */
+void handle_player_notifications(){
+    while(player_notifications_tail != player_notifications_head){
+        uint32_t notification = player_notifications[player_notifications_tail & (PLAYER_EVENT_QUEUE_SIZE - 1)];
+        __dmb();
+        player_notifications_tail++;
+        switch(notification >> 16){
+            case NOTIFY_TRACK_COMPLETED:
+                track_completed();
+            break;
+            case NOTIFY_TRACK_MISSING:
+                track_missing(notification & 0xFFFF);
+            break;
+            case NOTIFY_TRACK_ADVANCED:
+                track_advanced(notification & 0xFFFF);
+            break;
+            case NOTIFY_TRACK_ENDED:
+                stats_completed(notification & 0xFFFF);
+            break;
+        }
+    }
+}
+
+/**
+ * Player engine, running on core 1. It owns the UART and the BUSY pin, paces
+ * the commands queued by core 0 and reports back through player_notify().
+ */
+
+/**
+ * @brief Take the oldest command from the queue
+ * @param hold True if a PLAY taken now waits for a fade-out before it is sent
+ * @return The command, or STATUS if the queue is empty
+ */
+uint8_t __not_in_flash_func(player_next_command)(bool hold){
+    uint8_t tail = player_queue_tail;
+    if(tail == player_queue_head){ return STATUS; }
+    __dmb();
+    uint8_t command = player_queue[tail & (PLAYER_QUEUE_SIZE - 1)];
+    // Clear the pending flag before the command reads its value, so that
+    // a new request arriving from now on is queued again. A held PLAY stays
+    // pending until it is sent, so that new requests are folded into it.
+    if(!(hold && command == PLAY)){ player_queue_pending[command] = false; }
+    __dmb();
+    player_queue_tail = tail + 1;
+    return command;
+}
+
+/**
+ * @brief Send a notification to core 0
+ * @param type One of the NOTIFY_ types
+ * @param arg Notification argument
+ */
+void __not_in_flash_func(player_notify)(uint8_t type, uint16_t arg){
+    uint8_t head = player_notifications_head;
+    if((uint8_t)(head - player_notifications_tail) >= PLAYER_EVENT_QUEUE_SIZE){ return; }
+    player_notifications[head & (PLAYER_EVENT_QUEUE_SIZE - 1)] = ((uint32_t)type << 16) | arg;
+    __dmb();
+    player_notifications_head = head + 1;
+    __sev(); // Wake up core 0
+}
+
+/**
+ * @brief Handle a player status reading, reporting a completed track to core 0
+ * @param player_status PLAYING or PAUSED_OR_IDLE
+ */
+// When core 0 has armed the next track, it is played by the next poll_player()
+// without waiting for the status polling or for core 0.
+void update_player_status(uint8_t player_status){
+    if(player_status != status){
+        TRACE_EVENT(TRACE_STATUS, player_status);
+        status = player_status;
+        if(player_status == PAUSED_OR_IDLE){
+            #if TRACE
+            player_track_ended_at = time_us_64();
+            #endif
+            // Ended while fading out: the held command decides what comes next
+            if(player_fade_command != STATUS){ return; }
+            uint16_t track = player_next_track;
+            if(track && !is_paused){
+                player_advance_track = track;
+                TRACE_EVENT(TRACE_ADVANCED, track);
+                // Counted now: a PLAY requested in the meantime may replace the armed track
+                player_notify(NOTIFY_TRACK_ENDED, player_last_track);
+            } else {
+                TRACE_EVENT(TRACE_COMPLETED, player_last_track);
+                player_notify(NOTIFY_TRACK_COMPLETED, player_last_track);
+            }
+        }
+    }
+}
+
+/**
+ * @brief Send a frame to the player
+ * @param cmd Frame command
+ * @param arg Command argument
+ */
+// Built here instead of by the library, so that the checksum can be left out
+// for the clones that reject it. No acknowledgement is requested.
+void player_send(uint8_t cmd, uint16_t arg){
+    uint8_t frame[FRAME_SIZE] = {FRAME_START, FRAME_VERSION, FRAME_LENGTH, cmd, 0, arg >> 8, arg & 0xFF};
+    uint8_t length = 7;
+    if(player_profile->checksum_tx){
+        uint16_t sum = 0;
+        for(uint8_t i = 1; i < 7; i++){ sum += frame[i]; }
+        sum = -sum;
+        frame[length++] = sum >> 8;
+        frame[length++] = sum & 0xFF;
+    }
+    frame[length++] = FRAME_END;
+    uart_write_blocking(DFPLAYER_UART, frame, length);
+}
+
+/**
+ * @brief Check player status
+ */
+// Status queries are unreliable with some of the different chips found on
+// DFPlayer clones. player_probe() leaves the checksum out when that helps;
+// otherwise you have to rely on the BUSY pin: see USE_BUSY_PIN.
+// The reply is handled by handle_player_event().
+void check_player_status(){
+    player_send(FRAME_STATUS, 0);
+}
+
+#if USE_BUSY_PIN
+/**
+ * @brief Schedule the next check of the BUSY pin
+ * @param at Time in microseconds, 0 to cancel the check
+ */
+void busy_check_schedule(uint64_t at){
+    uint32_t irq_status = save_and_disable_interrupts(); // See busy_check_at
+    busy_check_at = at;
+    restore_interrupts(irq_status);
+}
+#endif
+
+/**
+ * @brief Handle a frame received from the player
+ * @param event Frame command and argument
+ */
+void handle_player_event(player_event_t *event){
+    uint8_t player_status;
+    TRACE_EVENT(TRACE_RX, event->cmd);
+    switch(event->cmd){
+        case FRAME_STATUS:
+            if(player_probe_sent && !player_probe_latency){
+                player_probe_latency = MAX(1, time_us_64() - player_probe_sent);
+            }
+            #if BENCHMARK
+            if(bench_status_at){
+                bench_record(BENCH_ACK, bench_status_at);
+                bench_status_at = 0;
+            }
+            #endif
+            // The low byte is 0 when stopped, 1 when playing, 2 when paused
+            player_status = ((event->arg & 0xFF) == 1) ? PLAYING : PAUSED_OR_IDLE;
+            #if USE_BUSY_PIN
+            // Only a sanity check: the reading is trusted when it agrees with the BUSY pin,
+            // which covers an edge that was missed by busy_irq_handler()
+            if(player_status != !gpio_get(BUSY_PIN)){ break; }
+            #endif
+            update_player_status(player_status);
+        break;
+        case FRAME_PLAY_FINISHED:
+            // Some clones report the same track twice, or late when it has
+            // already been replaced
+            if(time_us_64() - player_last_play < PLAY_SETTLE_MS * 1000){ break; }
+            update_player_status(PAUSED_OR_IDLE);
+        break;
+        case FRAME_READY:
+            if(!player_ready){
+                player_ready = true;
+                TRACE_EVENT(TRACE_READY, 0);
+            }
+        break;
+        case FRAME_ERROR:
+            TRACE_EVENT(TRACE_ERROR, event->arg);
+            if(event->arg == ERROR_NOT_FOUND || event->arg == ERROR_OUT_OF_RANGE){
+                // The track never started: it has not completed either
+                status = PAUSED_OR_IDLE;
+                #if USE_BUSY_PIN
+                busy_check_schedule(0);
+                #endif
+                TRACE_EVENT(TRACE_MISSING, player_last_track);
+                player_notify(NOTIFY_TRACK_MISSING, player_last_track);
+            }
+        break;
+        case FRAME_FILE_COUNT:
+            TRACE_EVENT(TRACE_FILE_COUNT, event->arg);
+            if(event->arg > 0){ num_tracks = MIN(event->arg, NUM_TRACKS); }
+        break;
+    }
+}
+
+/**
+ * @brief Decode the frames sent by the player. Called by the UART RX interrupt.
+ */
+void __not_in_flash_func(dfplayer_rx_handler)(){
+    static uint8_t frame[FRAME_SIZE];
+    static uint8_t length;
+    while(uart_is_readable(DFPLAYER_UART)){
+        uint8_t c = uart_getc(DFPLAYER_UART);
+        if(length == 0 && c != FRAME_START){ continue; } // Wait for the start of a frame
+        frame[length++] = c;
+        if(length < FRAME_SIZE){ continue; }
+        length = 0;
+
+        // Checksum is the two's complement of the sum of version, length, command,
+        // feedback and argument bytes
+        uint16_t sum = 0;
+        for(uint8_t i = 1; i < 7; i++){ sum += frame[i]; }
+        uint16_t checksum = (frame[7] << 8) | frame[8];
+        if(frame[9] != FRAME_END){ continue; }
+        if((uint16_t)(sum + checksum) != 0){
+            player_rx_bad_checksum++;
+            // Until the probe is over, the profile may be wrong about the checksum,
+            // and a READY frame is taken whatever its checksum
+            if(player_profile->checksum_rx && (player_probed || frame[3] != FRAME_READY)){ continue; }
+        }
+
+        uint8_t head = player_events_head;
+        if((uint8_t)(head - player_events_tail) >= PLAYER_EVENT_QUEUE_SIZE){ continue; }
+        player_events[head & (PLAYER_EVENT_QUEUE_SIZE - 1)].cmd = frame[3];
+        player_events[head & (PLAYER_EVENT_QUEUE_SIZE - 1)].arg = (frame[5] << 8) | frame[6];
+        player_events_head = head + 1;
+    }
+}
+
+#if USE_BUSY_PIN
+/**
+ * @brief BUSY pin edge interrupt handler
+ */
+void __not_in_flash_func(busy_irq_handler)(){
+    uint32_t events = gpio_get_irq_event_mask(BUSY_PIN);
+    if(!(events & (GPIO_IRQ_EDGE_RISE | GPIO_IRQ_EDGE_FALL))){ return; }
+    gpio_acknowledge_irq(BUSY_PIN, events);
+    // Act on the level once it has been stable for BUSY_GLITCH_MS
+    busy_check_at = time_us_64() + BUSY_GLITCH_MS * 1000;
+}
+
+/**
+ * @brief Act on the level of the BUSY pin once it is stable
+ */
+void busy_check(){
+    // An edge arriving meanwhile is not lost: its check is scheduled after this one
+    uint32_t irq_status = save_and_disable_interrupts(); // See busy_check_at
+    if(!busy_check_at || time_us_64() < busy_check_at){
+        restore_interrupts(irq_status);
+        return;
+    }
+    uint8_t player_status = !gpio_get(BUSY_PIN); // BUSY is low while a track is playing
+    uint64_t since_play = time_us_64() - player_last_play;
+    if(player_status == PAUSED_OR_IDLE && since_play < PLAY_SETTLE_MS * 1000){
+        // The pin goes high for a moment when the player switches tracks
+        busy_check_at = player_last_play + PLAY_SETTLE_MS * 1000;
+        restore_interrupts(irq_status);
+        return;
+    }
+    busy_check_at = 0;
+    restore_interrupts(irq_status);
+    #if TRACE
+    if(player_status == PLAYING && player_track_ended_at){
+        // The edge was BUSY_GLITCH_MS before the check
+        uint64_t started_at = time_us_64() - BUSY_GLITCH_MS * 1000;
+        TRACE_EVENT(TRACE_GAP, (started_at - player_track_ended_at) / 1000);
+        player_track_ended_at = 0;
+    }
+    #endif
+    update_player_status(player_status);
+}
+#endif
+
+/**
+ * @brief Interval between two status checks
+ * @return Interval in microseconds
+ */
+uint32_t status_interval_us(){
+    #if USE_BUSY_PIN
+    // Only a sanity check, left out when the replies cannot be trusted
+    if(!player_profile->status){ return UINT32_MAX; }
+    uint32_t interval = BUSY_STATUS_CHECK_MS * 1000;
+    #else
+    uint32_t interval = player_profile->poll_ms * 1000;
+    #endif
+    return battery_profile == BATTERY_NORMAL ? interval : interval * POWER_SAVING_POLL_FACTOR;
+}
+
+/**
+ * @brief Fingerprint the player from its replies to a status query, and pick its profile
+ */
+// The query is sent with a checksum, then without one if there was no reply.
+// A reply with a wrong checksum still counts, and the profile keeps the
+// checksum setting of the query that got it. The commands queued meanwhile
+// wait until the profile is known.
+void player_probe(){
+    uint64_t now = time_us_64();
+    if(player_probe_sent){
+        bool bad_reply = player_rx_bad_checksum != player_probe_bad;
+        if(!player_probe_latency && !bad_reply && now - player_probe_sent < PLAYER_PROBE_TIMEOUT_MS * 1000){ return; }
+        uint8_t profile;
+        if(player_probe_latency){
+            if(!player_profile->checksum_tx){
+                profile = PROFILE_NO_CHECKSUM;
+            } else if(player_probe_latency < PLAYER_PROBE_FAST_MS * 1000){
+                profile = PROFILE_FAST;
+            } else {
+                profile = PROFILE_STANDARD;
+            }
+        } else if(bad_reply){
+            profile = player_profile->checksum_tx ? PROFILE_LENIENT_RX : PROFILE_LENIENT_RX_NO_CHECKSUM;
+        } else if(player_profile->checksum_tx){
+            // Try again without a checksum
+            player_profile = &PLAYER_PROFILES[PROFILE_NO_CHECKSUM];
+            player_probe_sent = 0;
+            return;
+        } else {
+            profile = PROFILE_NO_STATUS;
+        }
+        player_profile = &PLAYER_PROFILES[profile];
+        player_probed = true;
+        player_last_tx = now;
+        TRACE_EVENT(TRACE_PROFILE, profile);
+        return;
+    }
+    if(now - player_last_tx < player_profile->min_gap_ms * 1000){ return; }
+    player_probe_bad = player_rx_bad_checksum;
+    check_player_status();
+    player_probe_sent = player_last_tx = time_us_64();
+}
+
+/**
+ * @brief Change the system clock
+ * @param khz Frequency in kHz
+ */
+// Called by core 1 between two frames, see power_request_clock().
+// On the RP2350 the system PLL keeps running at RUN_CLOCK_KHZ and the lower
+// clocks are divided down from it: there is no PLL to relock, so waking up
+// takes a few cycles instead of the PLL lock time.
+void power_set_clock(uint32_t khz){
+    #if PICO_RP2350
+    clock_configure(clk_sys, CLOCKS_CLK_SYS_CTRL_SRC_VALUE_CLKSRC_CLK_SYS_AUX,
+        CLOCKS_CLK_SYS_CTRL_AUXSRC_VALUE_CLKSRC_PLL_SYS, RUN_CLOCK_KHZ * 1000, khz * 1000);
+    clock_configure(clk_peri, 0, CLOCKS_CLK_PERI_CTRL_AUXSRC_VALUE_CLK_SYS, khz * 1000, khz * 1000);
+    #else
+    set_sys_clock_khz(khz, true);
+    #endif
+    uart_set_baudrate(DFPLAYER_UART, 9600); // The UART is clocked by the system clock
+}
+
+/**
+ * @brief Execute the next player command, or check the status when idle
+ */
+void poll_player(){
+    while(player_events_tail != player_events_head){
+        handle_player_event(&player_events[player_events_tail & (PLAYER_EVENT_QUEUE_SIZE - 1)]);
+        player_events_tail++;
+    }
+    if(power_clock_request){
+        // The UART is idle once the last frame has left its FIFO
+        uart_tx_wait_blocking(DFPLAYER_UART);
+        power_set_clock(power_clock_request);
+        power_clock_request = 0;
+    }
+    #if USE_BUSY_PIN
+    busy_check();
+    #endif
+    #if BENCHMARK
+    if(bench_end_requested){
+        // As if the BUSY pin had gone high
+        bench_end_requested = false;
+        bench_end_at = time_us_32();
+        status = PLAYING;
+        update_player_status(PAUSED_OR_IDLE);
+    }
+    #endif
+
+    uint64_t now = time_us_64();
+    if(!player_ready){
+        if(now < DFPLAYER_INIT_TIMEOUT_MS * 1000ULL){ return; }
+        // The player was already powered, so it did not report when it booted
+        player_ready = true;
+        TRACE_EVENT(TRACE_READY, 1);
+    }
+    if(!player_probed){
+        player_probe();
+        return;
+    }
+
+    // A track requested in the meantime replaces the armed one
+    if(player_advance_track && player_queue_pending[PLAY]){ player_advance_track = 0; }
+
+    uint8_t command;
+    // The fades take FADE_STEPS frames, whatever the volume
+    uint8_t fade_step = MAX(1, (volume + FADE_STEPS - 1) / FADE_STEPS);
+    if(player_fade_command != STATUS){
+        // Fading out: the held command goes once the volume is down,
+        // or as soon as the track has ended
+        if(now - player_last_tx < player_profile->min_gap_ms * 1000){ return; }
+        if(status == PLAYING && player_volume > 0){
+            command = FADE;
+            player_volume -= MIN(fade_step, player_volume);
+        } else {
+            command = player_fade_command;
+            player_fade_command = STATUS;
+            player_advance_track = 0; // Superseded by the held command
+            if(command == PLAY){
+                // See player_next_command()
+                player_queue_pending[PLAY] = false;
+                __dmb();
+            }
+        }
+    } else if(player_advance_track){
+        // Auto-advance goes ahead of the queue and of the status polling
+        if(now - player_last_tx < player_profile->min_gap_ms * 1000){ return; }
+        command = PLAY;
+    } else if(player_queue_head != player_queue_tail){
+        if(now - player_last_tx < player_profile->min_gap_ms * 1000){ return; }
+        bool fade_out = FADE_TRANSITIONS && status == PLAYING && player_volume > 0;
+        command = player_next_command(fade_out);
+        if(fade_out && (command == PLAY || command == PAUSE)){
+            // Frames queued behind it keep waiting, so that their order is kept
+            player_fade_command = command;
+            command = FADE;
+            player_volume -= MIN(fade_step, player_volume);
+        }
+    } else if(FADE_TRANSITIONS && player_volume < volume && !is_paused){
+        // Fading in, after a track change or a resume
+        if(now - player_last_tx < player_profile->min_gap_ms * 1000){ return; }
+        command = FADE;
+        player_volume = MIN(volume, player_volume + fade_step);
+    } else {
+        // Nothing to send: check the status, unless it was checked recently
+        if(power_idle || now - player_last_tx < status_interval_us()){ return; }
+        command = STATUS;
+    }
+
+    switch(command){
+        case PLAY:
+            player_last_track = player_advance_track ? player_advance_track : current_track;
+            player_send(FRAME_PLAY, player_last_track);
+            player_last_play = time_us_64();
+            // Core 0 follows the armed track only once it has actually been sent
+            if(player_advance_track){ player_notify(NOTIFY_TRACK_ADVANCED, player_advance_track); }
+            player_advance_track = 0;
+            #if TRACE && !USE_BUSY_PIN
+            if(player_track_ended_at){
+                TRACE_EVENT(TRACE_GAP, (player_last_play - player_track_ended_at) / 1000);
+                player_track_ended_at = 0;
+            }
+            #endif
+            // Assume the track starts, so that its end is noticed as a change
+            update_player_status(PLAYING);
+            #if USE_BUSY_PIN
+            // Confirm that the track has started once the pin has settled
+            busy_check_schedule(player_last_play + PLAY_SETTLE_MS * 1000);
+            #endif
+        break;
+        case VOLUME:
+            player_volume = volume;
+            player_send(FRAME_VOLUME, volume);
+        break;
+        case FADE:
+            player_send(FRAME_VOLUME, player_volume);
+        break;
+        case EQ:
+            player_send(FRAME_EQ, eq);
+        break;
+        case PAUSE:
+            player_send(FRAME_PAUSE, 0);
+        break;
+        case RESUME:
+            player_send(FRAME_RESUME, 0);
+        break;
+        case FILE_COUNT:
+            player_send(FRAME_FILE_COUNT, 0);
+        break;
+        case STATUS:
+            check_player_status();
+        break;
+    }
+    player_last_tx = time_us_64();
+    TRACE_EVENT(TRACE_TX, command);
+    #if BENCHMARK
+    if(command == STATUS){ bench_status_at = time_us_32(); }
+    if(command == VOLUME && bench_key_at){
+        bench_record(BENCH_SEND, bench_stage_at);
+        bench_record(BENCH_KEY_TO_TX, bench_key_at);
+        bench_key_at = 0;
+    }
+    if(command == PLAY && bench_end_at){
+        bench_record(BENCH_END_TO_PLAY, bench_end_at);
+        bench_end_at = 0;
+    }
+    #endif
+    #if TRACE
+    if(power_wake_time && command != STATUS){
+        TRACE_EVENT(TRACE_WAKE, MIN((player_last_tx - power_wake_time) / 100, UINT16_MAX));
+        power_wake_time = 0;
+    }
+    #endif
+}
+
+/**
+ * @brief Time poll_player() has something to do
+ * @return Time in microseconds, or UINT64_MAX if it only has to wait for new requests or frames
+ */
+// Queued commands go out as soon as the minimum gap of the player profile has
+// passed since the previous frame; the status is only polled when there is nothing else to send.
+// Until the player reports that it is ready, commands wait in the queue.
+// The volume frames of a fade are paced the same way as queued commands.
+uint64_t player_next_deadline(){
+    uint64_t due = UINT64_MAX;
+    if(player_events_head != player_events_tail || power_clock_request){
+        return 0;
+    } else if(!player_ready){
+        due = DFPLAYER_INIT_TIMEOUT_MS * 1000ULL; // Since boot
+    } else if(!player_probed){
+        due = player_probe_sent ? player_probe_sent + PLAYER_PROBE_TIMEOUT_MS * 1000
+            : player_last_tx + player_profile->min_gap_ms * 1000;
+    } else if(player_fade_command != STATUS || player_advance_track || player_queue_head != player_queue_tail
+        || (FADE_TRANSITIONS && player_volume < volume && !is_paused)){
+        due = player_last_tx + player_profile->min_gap_ms * 1000;
+    } else if(!power_idle){
+        due = player_last_tx + status_interval_us();
+    }
+    #if USE_BUSY_PIN
+    uint32_t irq_status = save_and_disable_interrupts(); // See busy_check_at
+    uint64_t check_at = busy_check_at;
+    restore_interrupts(irq_status);
+    if(check_at && check_at < due){ due = check_at; }
+    #endif
+    return due;
+}
+
+/**
+ * @brief Set up the player engine on core 1
+ */
+// Blocking UART transfers on this core cannot delay the keypad scan or the
+// buzzer on core 0. The loop sleeps until the next deadline, or until a
+// request from core 0 or an interrupt wakes it up.
+void player_core_init(){
+    multicore_lockout_victim_init(); // Lets core 0 write to flash safely
+
+    dfplayer_init(&dfplayer, DFPLAYER_UART, GPIO_TX, GPIO_RX);
+
+    // Frames sent by the player are decoded as they arrive. The interrupt is
+    // enabled from this core, so that it is handled here.
+    uint8_t uart_irq = uart_get_index(DFPLAYER_UART) ? UART1_IRQ : UART0_IRQ;
+    irq_set_exclusive_handler(uart_irq, dfplayer_rx_handler);
+    irq_set_enabled(uart_irq, true);
+    uart_set_irq_enables(DFPLAYER_UART, true, false);
+
+    gpio_init(BUSY_PIN);
+    gpio_set_dir(BUSY_PIN, GPIO_IN);
+    #if USE_BUSY_PIN
+    // A raw handler leaves the GPIO callback used by the button library untouched
+    gpio_add_raw_irq_handler(BUSY_PIN, busy_irq_handler);
+    gpio_set_irq_enabled(BUSY_PIN, GPIO_IRQ_EDGE_RISE | GPIO_IRQ_EDGE_FALL, true);
+    irq_set_enabled(IO_IRQ_BANK0, true);
+    #endif
+}
+
+/**
+ * @brief Core 1 entry point
+ */
+void player_core_main(){
+    player_core_init();
+    while(true){
+        poll_player();
+        uint64_t due = player_next_deadline();
+        if(due == UINT64_MAX){
+            __wfe();
+        } else if(due > time_us_64()){
+            best_effort_wfe_or_timeout(from_us_since_boot(due));
+        }
+    }
+}
+
+/**
+ * @brief Queue a key event for the main loop
+ * @param event Key index, with KEY_LONG_PRESS set for a long press, or one of the KEY_EVENT_ events
+ */
+void __not_in_flash_func(key_event_push)(uint8_t event){
+    uint32_t irq_status = save_and_disable_interrupts(); // The button interrupt can preempt the timers
+    uint8_t head = key_events_head;
+    if((uint8_t)(head - key_events_tail) >= KEY_EVENT_QUEUE_SIZE){
+        restore_interrupts(irq_status);
+        return;
+    }
+    key_events[head & (KEY_EVENT_QUEUE_SIZE - 1)] = event;
+    key_events_head = head + 1;
+    restore_interrupts(irq_status);
+    TRACE_EVENT(TRACE_KEY, event);
+    #if BENCHMARK
+    if(bench_key_at){ bench_stage_at = bench_record(BENCH_DEBOUNCE, bench_key_at); }
+    #endif
+    __sev(); // Wake up the main loop
+}
+
+/**
+ * @brief Play the track ID typed so far, or queue it if a track is playing
+ * @param now True to play it even if a track is playing
+ * @return True if it was a valid track number
+ */
+bool commit_track_id(bool now){
+    timer_cancel(TIMER_INPUT);
+    uint16_t track = track_id_prompt;
+    track_id_prompt = 0;
+    if(track == 0 || track > num_tracks){ return false; }
+    if(DIAL_ENQUEUE && !now && status == PLAYING && !is_paused){
+        if(upcoming_add(track)){
+            play_melody(POSITIVE, SOUND_FEEDBACK);
+        } else {
+            play_melody(NEGATIVE, SOUND_FEEDBACK);
+        }
+        #if DEBUG
+        printf("Queued track: %d\n", track);
+        #endif
+        return true;
+    }
+    shuffling = false;
+    play_track(track, KEY_NONE);
+    return true;
+}
+
+/**
+ * @brief Input timeout callback
+ * @return 0
+ */
+int64_t input_timeout(){
+    key_event_push(KEY_EVENT_INPUT_TIMEOUT);
+    return 0;
+}
+
+/**
+ * @brief Type track ID
+ * @param n Digit to type
+ */
+// The number is played as soon as no other digit could extend it into a
+// valid track number: with 999 tracks, the third digit always plays. Otherwise
+// it is played after a timeout that follows how fast the user dials, or at
+// once with the extra button, see button_pressed().
+void type_track_id(uint8_t n){
+    uint32_t now = to_ms_since_boot(get_absolute_time());
+    if(timer_armed(TIMER_INPUT)){
+        // Not the first digit of the number
+        uint32_t interval = MIN(now - dial_last_digit, INPUT_TIMEOUT_MS);
+        dial_interval_ms = (3 * dial_interval_ms + interval) / 4;
+        timer_cancel(TIMER_INPUT);
+    }
+    dial_last_digit = now;
+    track_id_prompt *= 10;
+    track_id_prompt += n;
+    dial_recent = (dial_recent * 10 + n) % 10000;
+    #if DEBUG
+    printf("track_id_prompt: %d\n", track_id_prompt);
+    #endif
+
+    // Here is where I would hide another easter egg. For example:
+    if(dial_recent == 7777){
+        play_melody(VICTORY, SOUND_FANFARE);
+        track_id_prompt = 0;
+        dial_recent = 0;
+        return;
+    }
+
+    if((uint32_t)track_id_prompt * 10 > num_tracks){
+        commit_track_id(false);
+        return;
+    }
+    uint32_t timeout = MAX(INPUT_TIMEOUT_MIN_MS, MIN(INPUT_TIMEOUT_MS, 2 * dial_interval_ms));
+    timer_arm(TIMER_INPUT, input_timeout, timeout * 1000);
+}
+
+/**
+ * @brief Record user activity, waking up from the low-power idle mode if needed
+ */
+void power_activity(){
+    power_last_activity = to_ms_since_boot(get_absolute_time());
+    if(power_idle){
+        power_wake_requested = true;
+        __sev();
+    }
+}
+
+/**
+ * @brief Check whether a key is still held down
+ * @param key Key index
+ * @return True if the key is down
+ */
+// Reads the key directly: the keypad library only reports presses. The
+// columns are driven low between two scans, and the rows are pulled down.
+bool key_held(uint8_t key){
+    uint8_t col = cols[key % sizeof(cols)];
+    uint8_t row = rows[key / sizeof(cols)];
+    gpio_put(col, 1);
+    busy_wait_us_32(2); // Let the row settle
+    bool held = gpio_get(row);
+    gpio_put(col, 0);
+    return held;
+}
+
+/**
+ * @brief Step the volume while the key is held. Called by the scheduler.
+ * @return Time until the next step in microseconds, 0 once the key is released
+ */
+// Runs from the same timer interrupt as the keypad scan, so the two never
+// drive the columns at the same time.
+// The steps themselves are taken by the main loop, like the key presses.
+int64_t volume_ramp(){
+    if(!volume_ramp_step || !key_held(volume_ramp_key)){
+        volume_ramp_step = 0;
+        return 0;
+    }
+    key_event_push(volume_ramp_step > 0 ? KEY_EVENT_VOLUME_UP : KEY_EVENT_VOLUME_DOWN);
+    return VOLUME_RAMP_MS * 1000;
+}
+
+/**
+ * @brief Start ramping the volume
+ * @param key Key being held
+ * @param step 1 to raise the volume, -1 to lower it
+ */
+void volume_ramp_start(uint8_t key, int8_t step){
+    volume_ramp_key = key;
+    volume_ramp_step = step;
+    timer_arm(TIMER_VOLUME_RAMP, volume_ramp, VOLUME_RAMP_MS * 1000);
+}
+
+/**
+ * @brief Run a keypad action
+ * @param action One of the KEY_ actions
+ * @param arg Action argument: the digit of KEY_DIGIT, or the key of a long press
+ */
+void key_action(uint8_t action, uint8_t arg){
+    switch(action){
+        case KEY_DIGIT:
+            type_track_id(arg);
+            break;
+        case KEY_PREV:
+            prev_track();
+            break;
+        case KEY_NEXT:
+            next_track();
+            break;
+        case KEY_RANDOM:
+            random_track();
+            break;
+        case KEY_VOLUMEDOWN:
+            volume_down();
+            #if DEBUG
+            printf("vol- %d\n", volume);
+            #endif
+            break;
+        case KEY_VOLUMEUP:
+            volume_up();
+            #if DEBUG
+            printf("vol+ %d\n", volume);
+            #endif
+            break;
+        case KEY_REPEAT:
+            toggle_repeat();
+            break;
+        case KEY_PAUSE:
+            toggle_pause();
+            break;
+        case KEY_EQ:
+            next_eq_preset();
+            break;
+        case KEY_PREV_GENRE:
+            prev_genre(key_press_track);
+            break;
+        case KEY_NEXT_GENRE:
+            next_genre(key_press_track);
+            break;
+        case KEY_GENRE_SHUFFLE:
+            toggle_genre_shuffle(key_press_track);
+            break;
+        case KEY_ENTER:
+            commit_track_id(true);
+            break;
+        case KEY_VOLUMEDOWN_RAMP:
+            volume_ramp_start(arg, -1);
+            break;
+        case KEY_VOLUMEUP_RAMP:
+            volume_ramp_start(arg, 1);
+            break;
+    }
+}
+
+/**
+ * @brief Remember the state that the short action of a key may change
+ */
+void key_press_save(){
+    key_press_track = current_track;
+    key_press_undo.track = current_track;
+    key_press_undo.started_at = stats_started_at;
+    if(current_track >= 1 && current_track <= NUM_TRACKS){ key_press_undo.stats = stats.record.tracks[current_track - 1]; }
+    key_press_undo.history_head = track_history_head;
+    key_press_undo.history_count = track_history_count;
+    key_press_undo.history_slot = track_history[track_history_head & (HISTORY_SIZE - 1)];
+    key_press_undo.upcoming_head = upcoming_head;
+    key_press_undo.upcoming_tail = upcoming_tail;
+    key_press_undo.upcoming_slot = upcoming[(uint8_t)(upcoming_head - 1) & (UPCOMING_SIZE - 1)];
+}
+
+/**
+ * @brief Undo the track change of the short action, before the long action replaces it
+ */
+// The track it moved to leaves no history entry and no play or skip behind.
+void key_press_revert(){
+    uint16_t track = key_press_undo.track;
+    if(current_track == track){ return; } // The short action did not change the track
+    if(current_track >= 1 && current_track <= NUM_TRACKS && stats.record.tracks[current_track - 1].plays){
+        stats.record.tracks[current_track - 1].plays--;
+    }
+    if(track >= 1 && track <= NUM_TRACKS){ stats.record.tracks[track - 1] = key_press_undo.stats; }
+    stats_started_at = key_press_undo.started_at;
+    stats_changed();
+    track_history_head = key_press_undo.history_head;
+    track_history_count = key_press_undo.history_count;
+    track_history[track_history_head & (HISTORY_SIZE - 1)] = key_press_undo.history_slot;
+    upcoming_head = key_press_undo.upcoming_head;
+    upcoming_tail = key_press_undo.upcoming_tail;
+    upcoming[(uint8_t)(upcoming_head - 1) & (UPCOMING_SIZE - 1)] = key_press_undo.upcoming_slot;
+    current_track = track;
+}
+
+/**
+ * @brief Key long pressed callback
+ * @param key Key that was pressed
+ */
+void key_long_pressed(uint8_t key){
+    if(key < count_of(KEYMAP)){
+        uint16_t track = current_track;
+        key_press_revert();
+        key_action(KEYMAP[key].long_action, key);
+        // Nothing to jump to: back to the track of the key press
+        if(track != current_track && current_track == key_press_track){ player_request(PLAY); }
+    }
+    blink(BLINK_DURATION_MS); // Feedback blink
+    beep(NOTE_C3, BEEP_DURATION_MS); // Feedback beep
+}
+
+/**
+ * @brief Key pressed callback
+ * @param key Key that was pressed
+ */
+// The layout of the keypad is defined by KEYMAP in config.h
+void key_pressed(uint8_t key){
+    blink(BLINK_DURATION_MS); // Feedback blink
+
+    if(key >= count_of(KEYMAP)){ return; }
+    const struct key_t *entry = &KEYMAP[key];
+    key_press_save();
+    key_action(entry->action, entry->arg);
+    if(entry->tone){ beep(entry->tone, BEEP_DURATION_MS); }
+}
+
+/**
+ * @brief Extra button pressed, called by the main loop
+ */
+void button_pressed(){
+    // Plays the number being typed, or restarts the current track
+    if(!commit_track_id(true)){ player_request(PLAY); }
+    blink(BLINK_DURATION_MS); // Feedback blink
+}
+
+/**
+ * @brief Button onchange callback
+ * @param button_p Button that changed
+ */
+void button_onchange(button_t *button_p){
+    button_t *button = (button_t*)button_p;
+    if(button->state) return;   // Ignore button release. Invert the logic if using
+                                // a pullup (internal or external).
+    switch(button->pin){
+        case BUTTON_1_PIN:
+            key_event_push(KEY_EVENT_BUTTON);
+        break;
+    }
+}
+
+/**
+ * @brief Key press available
+ * @param key Key that was pressed
+ * @return True if the key is not bouncing
+ */
+// Each key has its own debounce window, so that different keys
+// can be pressed back to back.
+bool __not_in_flash_func(keypress_available)(uint8_t key){
+    uint32_t bit = 1u << key;
+    if(keys_bouncing & bit){ return false; }
+    keys_bouncing |= bit;
+    key_last_press[key] = time_us_32();
+    return true;
+}
+
+/**
+ * @brief Close the debounce windows that have expired. Called by the keypad scan.
+ */
+void __not_in_flash_func(keypad_debounce)(){
+    uint32_t bouncing = keys_bouncing;
+    uint32_t now = time_us_32();
+    while(bouncing){
+        uint8_t key = __builtin_ctz(bouncing);
+        bouncing &= bouncing - 1;
+        if(now - key_last_press[key] >= KEYPAD_DEBOUNCE_US){
+            keys_bouncing &= ~(1u << key);
+        }
+    }
+}
+
+/**
+ * @brief Keypad press callback, called by the keypad scan
+ * @param key Key that was pressed
+ */
+void __not_in_flash_func(on_key_press)(uint8_t key){
+    if(!keypress_available(key)){ return; }
+    key_event_push(key);
+}
+
+/**
+ * @brief Keypad long press callback, called by the keypad scan
+ * @param key Key that was pressed
+ */
+void __not_in_flash_func(on_key_long_press)(uint8_t key){
+    key_event_push(key | KEY_LONG_PRESS);
+}
+
+/**
+ * @brief Scan the keypad matrix. Called by the scheduler.
+ * @return Time until the next scan in microseconds
+ */
+int64_t __not_in_flash_func(keypad_scan)(){
+    keypad_debounce();
+    keypad_read(&keypad);
+    return KEYPAD_SCAN_MS * 1000;
+}
+
+/**
+ * @brief Handle the queued key events
+ */
+void handle_key_events(){
+    while(key_events_tail != key_events_head){
+        uint8_t event = key_events[key_events_tail & (KEY_EVENT_QUEUE_SIZE - 1)];
+        key_events_tail++;
+        #if BENCHMARK
+        if(bench_key_at){ bench_stage_at = bench_record(BENCH_DISPATCH, bench_stage_at); }
+        #endif
+        if(event == KEY_EVENT_INPUT_TIMEOUT){
+            // A digit handled since then has restarted the timeout
+            if(!timer_armed(TIMER_INPUT)){ commit_track_id(false); }
+            continue;
+        }
+        power_activity();
+        if(event == KEY_EVENT_VOLUME_DOWN){
+            volume_down();
+        } else if(event == KEY_EVENT_VOLUME_UP){
+            volume_up();
+        } else if(event == KEY_EVENT_BUTTON){
+            button_pressed();
+        } else if(event & KEY_LONG_PRESS){
+            key_long_pressed(event & ~KEY_LONG_PRESS);
+        } else {
+            key_pressed(event);
+        }
+    }
+}
+
+#if BENCHMARK
+/**
+ * @brief Inject a synthetic event. Called by the scheduler.
+ * @return Time until the next event in microseconds
+ */
+// Key presses and track ends alternate. The key presses step the volume up
+// and down, so that the benchmark can run with a card in the player.
+int64_t bench_tick(){
+    static uint32_t tick;
+    tick++;
+    if(tick & 1){
+        uint8_t action = (tick & 2) ? KEY_VOLUMEUP : KEY_VOLUMEDOWN;
+        for(uint8_t key = 0; key < count_of(KEYMAP); key++){
+            if(KEYMAP[key].action != action){ continue; }
+            bench_key_at = time_us_32();
+            on_key_press(key); // As if the keypad scan had found it
+            break;
+        }
+    } else {
+        bench_end_requested = true;
+        __sev(); // Wake up core 1
+    }
+    return BENCHMARK_INTERVAL_MS * 1000;
+}
+
+/**
+ * @brief Compare two samples, for qsort()
+ */
+int bench_compare(const void *a, const void *b){
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * @brief Print the latency percentiles of each stage. Called by the main loop.
+ */
+void bench_report(){
+    static uint32_t last_report;
+    uint32_t now = to_ms_since_boot(get_absolute_time());
+    if(now - last_report < BENCHMARK_REPORT_MS){ return; }
+    last_report = now;
+    static uint32_t sorted[BENCHMARK_SAMPLES];
+    for(uint8_t stage = 0; stage < BENCH_STAGES; stage++){
+        uint16_t count = MIN(bench_count[stage], BENCHMARK_SAMPLES);
+        if(!count){ continue; }
+        memcpy(sorted, bench_samples[stage], count * sizeof(uint32_t));
+        qsort(sorted, count, sizeof(uint32_t), bench_compare);
+        printf("B %-12s n=%u\tp50=%uus\tp99=%uus\tmax=%uus\n", bench_names[stage], bench_count[stage],
+            (unsigned int)sorted[count / 2], (unsigned int)sorted[count * 99 / 100], (unsigned int)sorted[count - 1]);
+    }
+}
+#endif
+
+/**
+ * @brief FNV-1a hash
+ * @param data Bytes to hash
+ * @param length Number of bytes
+ * @return Hash
+ */
+uint32_t fnv1a(const void *data, size_t length){
+    const uint8_t *bytes = (const uint8_t *)data;
+    uint32_t hash = 2166136261u;
+    for(size_t i = 0; i < length; i++){
+        hash = (hash ^ bytes[i]) * 16777619u;
+    }
+    return hash;
+}
+
+/**
+ * @brief Checksum of a state record
+ * @param state Record
+ * @return FNV-1a hash of every field but the checksum
+ */
+uint32_t state_checksum(const saved_state_t *state){
+    return fnv1a(state, offsetof(saved_state_t, checksum));
+}
+
+/**
+ * @brief Record of the state log
+ * @param sector Sector of the log
+ * @param slot Record within the sector
+ * @return Pointer to the record in flash
+ */
+const saved_state_t *state_record(uint8_t sector, uint16_t slot){
+    return (const saved_state_t *)(XIP_BASE + STATE_OFFSET + sector * FLASH_SECTOR_SIZE) + slot;
+}
+
+/**
+ * @brief Restore the playback state saved to flash
+ */
+// Records are appended to a sector until it is full, then the log moves on to
+// the next sector, which is erased first. The newest record is found with a
+// binary search over the sector that starts with the highest sequence number.
+void state_restore(){
+    uint32_t best_sequence = 0;
+    bool found = false;
+    for(uint8_t sector = 0; sector < STATE_SECTORS; sector++){
+        const saved_state_t *first = state_record(sector, 0);
+        if(first->magic == STATE_MAGIC && (!found || (int32_t)(first->sequence - best_sequence) > 0)){
+            best_sequence = first->sequence;
+            state_sector = sector;
+            found = true;
+        }
+    }
+    if(!found){
+        state_sector = STATE_SECTORS - 1;
+        state_slot = STATE_SLOTS - 1; // The next record goes to the start of sector 0
+        return;
+    }
+
+    uint16_t low = 0, high = STATE_SLOTS - 1;
+    while(low < high){
+        uint16_t mid = (low + high + 1) / 2;
+        if(state_record(state_sector, mid)->magic == STATE_MAGIC){ low = mid; } else { high = mid - 1; }
+    }
+    state_slot = low;
+
+    // A record torn by a power cut has a bad checksum: fall back to the previous one
+    int16_t slot = low;
+    while(slot >= 0 && state_checksum(state_record(state_sector, slot)) != state_record(state_sector, slot)->checksum){
+        slot--;
+    }
+    if(slot < 0){ return; }
+    saved_state = *state_record(state_sector, slot);
+
+    current_track = saved_state.current_track;
+    playlist_index = saved_state.playlist_index;
+    volume = MIN(saved_state.volume, VOLUME_CEILING);
+    eq = saved_state.eq;
+    repeat = saved_state.repeat;
+    if(saved_state.shuffle_genre <= NUM_GENRES){ shuffle_genre = saved_state.shuffle_genre; }
+    if(saved_state.shuffle_seed && !SHUFFLE_SEED){
+        shuffle_seed = saved_state.shuffle_seed;
+        shuffle_epoch = saved_state.shuffle_epoch;
+        load_playlist();
+        shuffle_loaded = true;
+    }
+    #if DEBUG
+    printf("State restored: track %d\tvolume %d\teq %d\n", current_track, volume, eq);
+    #endif
+}
+
+/**
+ * @brief Flash write parameters for state_write()
  */
-void player_request(uint8_t command){
-    next_player_command = command;
-}
+typedef struct {
+    uint32_t offset;
+    bool erase;
+    uint8_t page[FLASH_PAGE_SIZE];
+} state_write_t;
 
 /**
- * @brief Next EQ preset
+ * @brief Write a page of the state log. Called through flash_safe_execute().
+ * @param param Flash write parameters
  */
-void next_eq_preset(){
-    eq++;
-    if(eq > 5){ eq = 0; }
-    player_request(EQ);
-    #if DEBUG
-    printf("next_eq_preset: %d\n", eq);
-    #endif
+void state_write(void *param){
+    state_write_t *write = (state_write_t *)param;
+    if(write->erase){
+        flash_range_erase(write->offset & ~(FLASH_SECTOR_SIZE - 1), FLASH_SECTOR_SIZE);
+    }
+    flash_range_program(write->offset & ~(FLASH_PAGE_SIZE - 1), write->page, FLASH_PAGE_SIZE);
 }
 
 /**
- * @brief Toggle pause mode
+ * @brief Append the current playback state to the log
  */
-void toggle_pause(){
-    if(is_paused){
-        player_request(RESUME);
-        is_paused = false;
-    } else { 
-        player_request(PAUSE);
-        is_paused = true;
+// The log only moves on once the record is written: if core 1 could not be
+// locked out in time, the same change is saved again after STATE_SAVE_DELAY_MS.
+void state_save(){
+    static state_write_t write;
+    saved_state_t record = saved_state;
+    record.magic = STATE_MAGIC;
+    record.sequence++;
+    record.shuffle_seed = shuffle_loaded ? shuffle_seed : 0;
+    record.shuffle_epoch = shuffle_epoch;
+    record.current_track = current_track;
+    record.playlist_index = playlist_index;
+    record.volume = volume;
+    record.eq = eq;
+    record.repeat = repeat;
+    record.shuffle_genre = shuffle_genre;
+    record.checksum = state_checksum(&record);
+
+    uint16_t slot = state_slot + 1;
+    uint8_t sector = state_sector;
+    write.erase = false;
+    if(slot >= STATE_SLOTS){
+        slot = 0;
+        sector = (sector + 1) % STATE_SECTORS;
+        write.erase = true;
+    }
+    write.offset = STATE_OFFSET + sector * FLASH_SECTOR_SIZE + slot * sizeof(saved_state_t);
+
+    // Programming only clears bits, so the rest of the page is left untouched
+    // by filling it with 0xFF
+    memset(write.page, 0xFF, FLASH_PAGE_SIZE);
+    memcpy(write.page + (write.offset & (FLASH_PAGE_SIZE - 1)), &record, sizeof(saved_state_t));
+    int result = flash_safe_execute(state_write, &write, 100);
+    if(result == PICO_OK){
+        saved_state = record;
+        state_slot = slot;
+        state_sector = sector;
+    } else {
+        state_changed_at = to_ms_since_boot(get_absolute_time());
     }
     #if DEBUG
-    printf("Toggle pause: %d\tstatus:%d\n", is_paused, status);
+    printf("State saved: %d\tsequence %u\n", result, (unsigned int)saved_state.sequence);
+    #else
+    (void)result;
     #endif
 }
 
 /**
- * @brief Play a random track
+ * @brief Checksum of the play statistics
+ * @param record Record
+ * @return FNV-1a hash of the statistics, up to the checksum
  */
-void random_track(){
-    static bool random_seeded;
-    if(!random_seeded){
-        srand(time_us_64());
-        randomize_playlist();
-        random_seeded = true;
-    }
-    current_track = shuffled_playlist[playlist_index];
-    #if DEBUG
-    printf("random_track: %d\tplaylist_index:%d\n", current_track, playlist_index);
-    #endif
-    player_request(PLAY);
-
-    playlist_index++;
-    if(playlist_index > NUM_TRACKS){
-        randomize_playlist();
-        playlist_index = 1;
-    }
+uint32_t stats_checksum(const saved_stats_t *record){
+    return fnv1a(record, offsetof(saved_stats_t, checksum));
 }
 
-// We could call dfplayer_previous() and dfplayer_next(), but some chips
-// in DFPlayer clones have trouble picking the right track when files have
-// not been transferred to the microSD card sequentially.
 /**
- * @brief Previous track
+ * @brief Restore the play statistics saved to flash
  */
-void prev_track(){
-    if(current_track > 1){
-        current_track--;
-        #if DEBUG
-        printf("prev_track: %d\n", current_track);
-        #endif
-        player_request(PLAY);
-        // Cancel repeat
-        repeat = false;
+// The two sectors are written in turn, so that a save torn by a power cut
+// leaves the previous one intact.
+void stats_restore(){
+    bool found = false;
+    for(uint8_t sector = 0; sector < STATS_SECTORS; sector++){
+        const saved_stats_t *record = (const saved_stats_t *)(XIP_BASE + STATS_OFFSET + sector * FLASH_SECTOR_SIZE);
+        if(record->magic != STATS_MAGIC || stats_checksum(record) != record->checksum){ continue; }
+        if(found && (int32_t)(record->sequence - stats.record.sequence) <= 0){ continue; }
+        stats.record = *record;
+        stats_sector = sector;
+        found = true;
     }
+    if(!found){ stats_sector = STATS_SECTORS - 1; } // The first save goes to sector 0
+    stats_saved_at = to_ms_since_boot(get_absolute_time());
 }
 
 /**
- * @brief Next track
+ * @brief Write the play statistics to a sector. Called through flash_safe_execute().
+ * @param param Sector number, a uint8_t
  */
-void next_track(){
-    if(current_track < NUM_TRACKS){
-        current_track++;
-        #if DEBUG
-        printf("next_track: %d\n", current_track);
-        #endif
-        player_request(PLAY);
-        // Cancel repeat
-        repeat = false;
-    }
+void stats_write(void *param){
+    uint32_t offset = STATS_OFFSET + *(uint8_t *)param * FLASH_SECTOR_SIZE;
+    flash_range_erase(offset, FLASH_SECTOR_SIZE);
+    flash_range_program(offset, stats.pages, sizeof(stats.pages));
 }
 
 /**
- * @brief Check player status
+ * @brief Save the play statistics to flash
  */
-void check_player_status(){
-    static uint8_t last_player_status = 0;
-    // dfplayer_get_status() is unreliable with some of the different chips found on
-    // DFPlayer clones. If calling dfplayer_set_checksum_tx(false) does not help
-    // (see library README) then you have to rely on reading the digital value of
-    // the BUSY pin on the player:
-    // uint8_t player_status = !gpio_get(BUSY_PIN);
-    uint8_t player_status = dfplayer_get_status(&dfplayer);
+void stats_save(){
+    stats.record.magic = STATS_MAGIC;
+    stats.record.sequence++;
+    stats.record.checksum = stats_checksum(&stats.record);
+    uint8_t sector = (stats_sector + 1) % STATS_SECTORS;
+    int result = flash_safe_execute(stats_write, &sector, 100);
+    // Otherwise tried again after STATS_SAVE_INTERVAL_MS
+    if(result == PICO_OK){
+        stats_sector = sector;
+        stats_dirty = false;
+    }
+    stats_saved_at = to_ms_since_boot(get_absolute_time());
     #if DEBUG
-    printf("status: %d\tcur_track: %d\trepeat: %d\n", player_status, current_track, repeat);
+    printf("Stats saved: %d\tsequence %u\n", result, (unsigned int)stats.record.sequence);
+    #else
+    (void)result;
     #endif
-    if(player_status != last_player_status){
-        #if DEBUG
-        printf("Status changed\n");
-        #endif
-        status = player_status;
-        if(player_status == 0 && !is_paused){
-            #if DEBUG
-            printf("Track completed\n");
-            #endif
-            if(repeat){
-                player_request(PLAY);
-            } else {
-                next_track();
-            }
-        }
-        last_player_status = player_status;
-    }
 }
 
 /**
- * @brief Execute the next player command. Called by the repeating timer.
- * @return True
+ * @brief Save the play statistics now and then, and keep the weighted shuffle up to date. Called by the main loop.
  */
-bool poll_player(){
-    switch(next_player_command){
-        case PLAY:
-            dfplayer_play(&dfplayer, current_track);
-        break;
-        case VOLUMEDOWN:
-            dfplayer_decrease_volume(&dfplayer);
-        break;
-        case VOLUMEUP:
-            dfplayer_increase_volume(&dfplayer);
-        break;
-        case EQ:
-            dfplayer_write(&dfplayer, CMD_EQ, eq);
-        break;
-        case PAUSE:
-            dfplayer_pause(&dfplayer);
-        break;
-        case RESUME:
-            dfplayer_resume(&dfplayer);
-        break;
-        case STATUS:
-        default:
-            check_player_status();
-        break;
+// Each save erases a sector, so they are far apart: a few plays may be lost
+// on a power cut, but the flash is not worn out.
+void stats_update(){
+    if(stats_dirty && to_ms_since_boot(get_absolute_time()) - stats_saved_at >= STATS_SAVE_INTERVAL_MS){
+        stats_save();
     }
-
-    next_player_command = STATUS;
-
-    return true;
+    #if WEIGHTED_SHUFFLE
+    static uint16_t weights_num_tracks;
+    if(weights_stale || weights_num_tracks != num_tracks){
+        weights_num_tracks = num_tracks;
+        weights_build();
+    }
+    #endif
 }
 
 /**
- * @brief Scheduled play callback
- * @return 0
+ * @brief Check if the playback state differs from the last saved one
+ * @return True if it needs saving
  */
-int64_t scheduled_play(){
-    player_request(PLAY);
-    return 0;
+bool state_changed(){
+    return current_track != saved_state.current_track
+        || playlist_index != saved_state.playlist_index
+        || volume != saved_state.volume
+        || eq != saved_state.eq
+        || repeat != saved_state.repeat
+        || shuffle_genre != saved_state.shuffle_genre
+        || (shuffle_loaded && (shuffle_seed != saved_state.shuffle_seed
+                               || shuffle_epoch != saved_state.shuffle_epoch));
 }
 
 /**
- * @brief Input timeout callback
- * @return 0
+ * @brief Save the playback state once it has stopped changing. Called by the main loop.
  */
-int64_t input_timeout(){
-    track_id_prompt = 0;
-    return 0;
+// Writes are batched: a burst of key presses only produces one record,
+// STATE_SAVE_DELAY_MS after the last change.
+void state_update(){
+    uint32_t now = to_ms_since_boot(get_absolute_time());
+    if(!state_changed()){
+        state_changed_at = now;
+        return;
+    }
+    if(now - state_changed_at >= STATE_SAVE_DELAY_MS){ state_save(); }
 }
 
 /**
- * @brief Type track ID
- * @param n Digit to type
+ * @brief Keypad wake-up interrupt handler, active while idle
  */
-void type_track_id(uint8_t n){
-    if(type_timeout_alarm){ cancel_alarm (type_timeout_alarm); }
-    type_timeout_alarm = add_alarm_in_ms(INPUT_TIMEOUT_MS, input_timeout, NULL, true);
-    track_id_prompt *= 10;
-    track_id_prompt += n;
-    #if DEBUG
-    printf("track_id_prompt: %d\n", track_id_prompt);
-    #endif
-
-    // Here is where I would hide another easter egg. For example:
-    if(track_id_prompt == 7777){ melody(&generator, VICTORY, 0); }
-
-    if(track_id_prompt > 0 && track_id_prompt <= NUM_TRACKS){
-        current_track = track_id_prompt;
-        if(scheduled_play_alarm){ cancel_alarm (scheduled_play_alarm); }
-        scheduled_play_alarm = add_alarm_in_ms(INPUT_TIMEOUT_MS, scheduled_play, NULL, true);
+void keypad_wake_handler(){
+    bool pressed = false;
+    for(uint8_t i = 0; i < sizeof(rows); i++){
+        if(gpio_get_irq_event_mask(rows[i]) & GPIO_IRQ_EDGE_RISE){ pressed = true; }
     }
+    // Raw handlers are called for every GPIO interrupt
+    if(!pressed){ return; }
+    for(uint8_t i = 0; i < sizeof(rows); i++){
+        gpio_set_irq_enabled(rows[i], GPIO_IRQ_EDGE_RISE, false);
+        gpio_acknowledge_irq(rows[i], GPIO_IRQ_EDGE_RISE);
+    }
+    power_wake_requested = true;
 }
 
 /**
- * @brief Key long pressed callback
- * @param key Key that was pressed
+ * @brief Ask core 1 to change the system clock
+ * @param khz Frequency in kHz
  */
-void key_long_pressed(uint8_t key){
-    switch(key){
-        case 13: // key 0
-            next_eq_preset();
-            break;
-    }
-    blink(BLINK_DURATION_MS); // Feedback blink
-    tone(&generator, NOTE_C3, BEEP_DURATION_MS); // Feedback beep
+// Core 1 owns the UART, and changes the clock between two frames
+void power_request_clock(uint32_t khz){
+    power_clock_request = khz;
+    __sev(); // Wake up core 1
 }
 
 /**
- * @brief Key press available
- * @return True if a key press is available
+ * @brief Enter the low-power idle mode
  */
-bool keypress_available(){
-    static uint64_t last_press;
-    uint64_t now = time_us_64();
-    if(now - last_press < KEYPAD_DEBOUNCE_US){
-        #if DEBUG
-        printf("Debounced");
-        #endif
-        return false;
+// The keypad scan and status polling are stopped and the system clock is
+// lowered; the main loop then sleeps in __wfe() until a key, the button or
+// the player wakes it up. Dormant mode is not used, as it would also stop
+// USB and the UART receiver.
+void power_enter_idle(){
+    TRACE_EVENT(TRACE_IDLE, 1);
+    #if DEBUG
+    printf("Entering idle mode\n");
+    #endif
+    if(state_changed()){ state_save(); }
+    if(stats_dirty){ stats_save(); }
+    timer_cancel(TIMER_KEYPAD);
+
+    power_idle = true; // Also stops the status polling on core 1
+    power_wake_requested = false;
+
+    // Any key now pulls its row high: the keypad library drives the
+    // columns and reads the rows with pull-downs
+    for(uint8_t i = 0; i < sizeof(cols); i++){ gpio_put(cols[i], 1); }
+    for(uint8_t i = 0; i < sizeof(rows); i++){
+        gpio_acknowledge_irq(rows[i], GPIO_IRQ_EDGE_RISE);
+        gpio_set_irq_enabled(rows[i], GPIO_IRQ_EDGE_RISE, true);
     }
-    last_press = now;
-    return true;
+
+    power_request_clock(POWER_IDLE_CLOCK_KHZ);
 }
 
 /**
- * @brief Key pressed callback
- * @param key Key that was pressed
+ * @brief System clock outside of the low-power idle mode
+ * @return Frequency in kHz
  */
-void key_pressed(uint8_t key){
+uint32_t power_clock_khz(){
+    return battery_profile == BATTERY_NORMAL ? RUN_CLOCK_KHZ : POWER_SAVING_CLOCK_KHZ;
+}
+
+/**
+ * @brief Leave the low-power idle mode
+ */
+void power_exit_idle(){
+    power_wake_time = time_us_64();
+    power_request_clock(power_clock_khz());
+
+    for(uint8_t i = 0; i < sizeof(rows); i++){ gpio_set_irq_enabled(rows[i], GPIO_IRQ_EDGE_RISE, false); }
+    for(uint8_t i = 0; i < sizeof(cols); i++){ gpio_put(cols[i], 0); }
+    timer_arm(TIMER_KEYPAD, keypad_scan, KEYPAD_SCAN_MS * 1000);
+
+    power_idle = false;
+    power_wake_requested = false;
+    power_last_activity = to_ms_since_boot(get_absolute_time());
+    __sev(); // Let core 1 resume the status polling
+    TRACE_EVENT(TRACE_IDLE, 0);
     #if DEBUG
-    printf("key: %d\n", key);
+    printf("Leaving idle mode\n");
     #endif
-
-    // Debounce
-    if(!keypress_available()){ return; }
-
-    blink(BLINK_DURATION_MS); // Feedback blink
-
-    switch(key){
-        // Numbers
-        case 0:
-            type_track_id(1);
-            tone(&generator, NOTE_C4, BEEP_DURATION_MS);
-            break;
-        case 1:
-            type_track_id(2);
-            tone(&generator, NOTE_CS4, BEEP_DURATION_MS);
-            break;
-        case 2:
-            type_track_id(3);
-            tone(&generator, NOTE_D4, BEEP_DURATION_MS);
-            break;
-        case 5:
-            type_track_id(4);
-            tone(&generator, NOTE_DS4, BEEP_DURATION_MS);
-            break;
-        case 6:
-            type_track_id(5);
-            tone(&generator, NOTE_E4, BEEP_DURATION_MS);
-            break;
-        case 7:
-            type_track_id(6);
-            tone(&generator, NOTE_F4, BEEP_DURATION_MS);
-            break;
-        case 10:
-            type_track_id(7);
-            tone(&generator, NOTE_FS4, BEEP_DURATION_MS);
-            break;
-        case 11:
-            type_track_id(8);
-            tone(&generator, NOTE_G4, BEEP_DURATION_MS);
-            break;
-        case 12:
-            type_track_id(9);
-            tone(&generator, NOTE_GS4, BEEP_DURATION_MS);
-            break;
-        case 15:
-            type_track_id(0);
-            tone(&generator, NOTE_AS4, BEEP_DURATION_MS);
-            break;
-        // Prev / Next (asterisk and little gate sign keys)
-        case 16:
-            prev_track();
-            tone(&generator, NOTE_A4, BEEP_DURATION_MS);
-            break;
-        case 17:
-            next_track();
-            tone(&generator, NOTE_B4, BEEP_DURATION_MS);
-            break;
-        // Additional keys
-        case 3:
-            random_track();
-            break;
-        case 19:
-            #if DEBUG
-            printf("vol-\n");
-            #endif
-            player_request(VOLUMEDOWN);
-            break;
-        case 13:
-            #if DEBUG
-            printf("vol+\n");
-            #endif
-            player_request(VOLUMEUP);
-            break;
-        // Note: on the specific telephone I used, the bottom left key (mute)
-        // is not part of the keypad matrix and is connected to its own pin.
-        // See button_onchange() below.
-        case 8:
-            toggle_repeat();
-            break;
-        case 18:
-            toggle_pause();
-            break;
-    }
 }
 
 /**
- * @brief Button onchange callback
- * @param button_p Button that changed
+ * @brief Enter or leave the low-power idle mode. Called by the main loop.
  */
-void button_onchange(button_t *button_p){
-    button_t *button = (button_t*)button_p;
-    if(button->state) return;   // Ignore button release. Invert the logic if using
-                                // a pullup (internal or external).
-    switch(button->pin){
-        case BUTTON_1_PIN:
-            player_request(PLAY);
-        break;
+void power_update(){
+    if(power_idle){
+        if(power_wake_requested){ power_exit_idle(); }
+        return;
+    }
+    uint32_t now = to_ms_since_boot(get_absolute_time());
+    if(status == PLAYING){
+        power_last_activity = now;
+    } else if(now - power_last_activity >= POWER_IDLE_TIMEOUT_MS){
+        power_enter_idle();
     }
-    blink(BLINK_DURATION_MS); // Feedback blink
 }
 
 /**
@@ -541,78 +3293,377 @@ void bi_decl_all(){
     bi_decl(bi_1pin_with_name(rows[2], "Keypad matrix row pin 3"));
     bi_decl(bi_1pin_with_name(rows[3], "Keypad matrix row pin 4"));
     bi_decl(bi_1pin_with_name(BUTTON_1_PIN, BUTTON_1_PIN_DESCRIPTION));
+    bi_decl(bi_1pin_with_name(BATTERY_PIN, BATTERY_PIN_DESCRIPTION));
     #endif
 }
 
 /**
- * @brief Low battery pulse callback
- * @return True
+ * @brief Start a burst of battery samples. Called by the scheduler.
+ * @return Time until the next burst in microseconds
  */
-bool low_batt_pulse(){
-    static bool flag;
-    gpio_put(LED_PIN, flag = !flag);
-    return true;
+// The ADC fills its FIFO and DMA empties it, so the CPU only
+// wakes up again when the burst is complete.
+int64_t battery_sample(){
+    if(!dma_channel_is_busy(battery_dma)){
+        adc_fifo_drain();
+        dma_channel_set_write_addr(battery_dma, battery_samples, false);
+        dma_channel_set_trans_count(battery_dma, BATTERY_BURST_SAMPLES, true);
+        adc_run(true);
+    }
+    return BATTERY_CHECK_MS * 1000;
+}
+
+/**
+ * @brief End of a burst of battery samples. Called by the DMA interrupt.
+ */
+void battery_dma_handler(){
+    if(!dma_channel_get_irq0_status(battery_dma)){ return; }
+    dma_channel_acknowledge_irq0(battery_dma);
+    adc_run(false);
+    adc_fifo_drain();
+    battery_burst_done = true;
+}
+
+/**
+ * @brief Set up the battery monitoring
+ */
+void battery_init(){
+    adc_init();
+    adc_gpio_init(BATTERY_PIN);
+    adc_select_input(BATTERY_ADC_INPUT);
+    adc_fifo_setup(true, true, 1, false, false); // One DMA request per 12-bit sample
+    adc_set_clkdiv(48000000.0f / BATTERY_SAMPLE_HZ - 1); // The ADC runs at 48MHz
+
+    battery_dma = dma_claim_unused_channel(true);
+    dma_channel_config config = dma_channel_get_default_config(battery_dma);
+    channel_config_set_transfer_data_size(&config, DMA_SIZE_16);
+    channel_config_set_read_increment(&config, false);
+    channel_config_set_write_increment(&config, true);
+    channel_config_set_dreq(&config, DREQ_ADC);
+    dma_channel_configure(battery_dma, &config, battery_samples, &adc_hw->fifo, BATTERY_BURST_SAMPLES, false);
+    dma_channel_set_irq0_enabled(battery_dma, true);
+    irq_add_shared_handler(DMA_IRQ_0, battery_dma_handler, PICO_SHARED_IRQ_HANDLER_DEFAULT_ORDER_PRIORITY);
+    irq_set_enabled(DMA_IRQ_0, true);
+
+    timer_arm(TIMER_BATTERY, battery_sample, 0);
+}
+
+/**
+ * @brief Charge left in the battery
+ * @param mv Battery voltage in millivolts
+ * @return Charge in percent
+ */
+// Rough discharge curve of a lithium cell under a light load
+uint8_t battery_percent(uint16_t mv){
+    static const uint16_t curve[][2] = {
+        {4200, 100}, {4000, 80}, {3850, 60}, {3750, 40}, {3650, 20}, {3500, 5}, {3300, 0},
+    };
+    if(mv >= curve[0][0]){ return 100; }
+    for(uint8_t i = 1; i < count_of(curve); i++){
+        if(mv >= curve[i][0]){
+            return curve[i][1] + (mv - curve[i][0]) * (curve[i - 1][1] - curve[i][1]) / (curve[i - 1][0] - curve[i][0]);
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Switch to a battery profile
+ * @param profile One of the BATTERY_ profiles
+ */
+void battery_set_profile(uint8_t profile){
+    #if DEBUG
+    printf("Battery profile: %d\t%dmV\n", profile, battery_mv);
+    #endif
+    bool clock_change = (profile == BATTERY_NORMAL) != (battery_profile == BATTERY_NORMAL);
+    battery_profile = profile;
+    if(clock_change && !power_idle){ power_request_clock(power_clock_khz()); }
+    if(profile == BATTERY_CRITICAL){ play_melody(NEGATIVE, SOUND_FEEDBACK); }
+}
+
+/**
+ * @brief Process a burst of battery samples. Called by the main loop.
+ */
+// The middle half of the sorted burst is averaged, which rejects the dips
+// caused by audio peaks, and successive readings are smoothed.
+void battery_update(){
+    if(!battery_burst_done){ return; }
+    battery_burst_done = false;
+
+    uint16_t sorted[BATTERY_BURST_SAMPLES];
+    memcpy(sorted, battery_samples, sizeof(sorted));
+    for(uint8_t i = 1; i < BATTERY_BURST_SAMPLES; i++){
+        uint16_t sample = sorted[i];
+        int8_t j = i - 1;
+        while(j >= 0 && sorted[j] > sample){ sorted[j + 1] = sorted[j]; j--; }
+        sorted[j + 1] = sample;
+    }
+    uint32_t sum = 0;
+    for(uint8_t i = BATTERY_BURST_SAMPLES / 4; i < BATTERY_BURST_SAMPLES * 3 / 4; i++){ sum += sorted[i]; }
+    uint16_t mv = sum * 3300 * BATTERY_DIVIDER / (4096 * (BATTERY_BURST_SAMPLES / 2));
+    battery_mv = battery_mv ? (3 * battery_mv + mv) / 4 : mv;
+
+    uint16_t load_ma = (status == PLAYING) ? BATTERY_PLAYING_MA : BATTERY_IDLE_MA;
+    battery_runtime_min = (uint32_t)BATTERY_CAPACITY_MAH * battery_percent(battery_mv) * 60 / (100 * load_ma);
+    #if DEBUG
+    printf("Battery: %dmV\t%d%%\t%d min left\n", battery_mv, battery_percent(battery_mv), battery_runtime_min);
+    #endif
+
+    uint8_t profile = battery_profile;
+    if(battery_mv < BATTERY_CRITICAL_MV){
+        profile = BATTERY_CRITICAL;
+    } else if(battery_mv < BATTERY_SAVING_MV){
+        profile = MAX(profile, BATTERY_SAVING);
+        if(battery_mv > BATTERY_CRITICAL_MV + BATTERY_HYSTERESIS_MV){ profile = BATTERY_SAVING; }
+    } else if(battery_mv > BATTERY_SAVING_MV + BATTERY_HYSTERESIS_MV){
+        profile = BATTERY_NORMAL;
+    } else if(profile == BATTERY_CRITICAL && battery_mv > BATTERY_CRITICAL_MV + BATTERY_HYSTERESIS_MV){
+        profile = BATTERY_SAVING;
+    }
+    if(profile != battery_profile){ battery_set_profile(profile); }
+
+    // Warning blink, in place of a timer of its own
+    if(battery_profile == BATTERY_CRITICAL){ blink(BLINK_DURATION_MS); }
+}
+
+#if REMOTE
+/**
+ * @brief Telemetry last sent to the host
+ */
+static uint16_t remote_sent[TELEMETRY_FIELDS];
+
+/**
+ * @brief Flag to indicate if the host has been sent all the telemetry
+ */
+static bool remote_synced;
+
+/**
+ * @brief Send a frame to the host
+ * @param type Frame type
+ * @param arg Frame argument
+ */
+// putchar_raw() skips the CRLF translation. A host that stops reading only
+// holds it up for PICO_STDIO_USB_STDOUT_TIMEOUT_US, see CMakeLists.txt.
+void remote_send(uint8_t type, uint16_t arg){
+    uint8_t frame[REMOTE_FRAME_SIZE] = {REMOTE_SYNC, type, arg >> 8, arg & 0xFF};
+    frame[4] = -(uint8_t)(frame[1] + frame[2] + frame[3]);
+    for(uint8_t i = 0; i < REMOTE_FRAME_SIZE; i++){ putchar_raw(frame[i]); }
+}
+
+/**
+ * @brief Current value of a telemetry field
+ * @param field Field index, from TELEMETRY_FIRST
+ * @return Value
+ */
+uint16_t remote_field(uint8_t field){
+    switch(field + TELEMETRY_FIRST){
+        case TELEMETRY_TRACK:
+            return current_track;
+        case TELEMETRY_STATE:
+            return (status == PLAYING ? TELEMETRY_PLAYING : 0) | (is_paused ? TELEMETRY_PAUSED : 0)
+                | (repeat ? TELEMETRY_REPEAT : 0) | (shuffling ? TELEMETRY_SHUFFLE : 0);
+        case TELEMETRY_VOLUME:
+            return volume;
+        case TELEMETRY_EQ:
+            return eq;
+        case TELEMETRY_BATTERY_MV:
+            return battery_mv;
+        case TELEMETRY_RUNTIME_MIN:
+            return battery_runtime_min;
+    }
+    return 0;
+}
+
+/**
+ * @brief Check a keypad action sent by the host
+ * @param action One of the KEY_ actions
+ * @param arg Action argument
+ * @return True if the action can be run remotely
+ */
+bool remote_action_allowed(uint8_t action, uint8_t arg){
+    switch(action){
+        case KEY_DIGIT:
+            return arg <= 9;
+        case KEY_PREV:
+        case KEY_NEXT:
+        case KEY_RANDOM:
+        case KEY_VOLUMEDOWN:
+        case KEY_VOLUMEUP:
+        case KEY_REPEAT:
+        case KEY_PAUSE:
+        case KEY_EQ:
+        case KEY_PREV_GENRE:
+        case KEY_NEXT_GENRE:
+        case KEY_GENRE_SHUFFLE:
+        case KEY_ENTER:
+            return true;
+        default:
+            // The ramps follow a key of the matrix for as long as it is held
+            return false;
+    }
+}
+
+/**
+ * @brief Run a command sent by the host
+ * @param type Frame type
+ * @param arg Frame argument
+ */
+// The commands go through the same actions as the keypad, and so through
+// the same player command queue.
+void remote_command(uint8_t type, uint16_t arg){
+    power_activity();
+    switch(type){
+        case REMOTE_KEY:
+            if(!remote_action_allowed(arg >> 8, arg & 0xFF)){ break; }
+            key_press_track = current_track; // Not preceded by a short press
+            key_action(arg >> 8, arg & 0xFF);
+            blink(BLINK_DURATION_MS); // Feedback blink
+        break;
+        case REMOTE_PLAY:
+            if(arg < 1 || arg > num_tracks){ break; }
+            shuffling = false;
+            play_track(arg, KEY_NONE);
+        break;
+        case REMOTE_VOLUME:
+            volume = MIN(arg, MIN(VOLUME_MAX, VOLUME_CEILING));
+            player_request(VOLUME);
+        break;
+        case REMOTE_QUERY:
+            remote_synced = false;
+        break;
+    }
+}
+
+/**
+ * @brief Read the commands sent by the host. Called by the main loop.
+ */
+// Never waits: at most REMOTE_RX_MAX bytes are taken per pass, and a frame
+// that is still incomplete is picked up again on the next pass.
+void remote_poll(){
+    static uint8_t frame[REMOTE_FRAME_SIZE];
+    static uint8_t length;
+    for(uint8_t n = 0; n < REMOTE_RX_MAX; n++){
+        int c = getchar_timeout_us(0);
+        if(c < 0){ return; } // Nothing left to read
+        if(length == 0 && c != REMOTE_SYNC){ continue; } // Wait for the start of a frame
+        frame[length++] = c;
+        if(length < REMOTE_FRAME_SIZE){ continue; }
+        length = 0;
+        if((uint8_t)(frame[1] + frame[2] + frame[3] + frame[4]) != 0){ continue; }
+        remote_command(frame[1], (frame[2] << 8) | frame[3]);
+    }
 }
 
 /**
- * @brief Battery low callback
- * @param battery_mv Battery voltage in millivolts
+ * @brief Send the telemetry that has changed. Called by the main loop.
  */
-void battery_low_callback(uint16_t battery_mv){
-    battery_check_stop();
-    add_repeating_timer_ms(200, low_batt_pulse, NULL, &low_batt_pulse_timer);
+void remote_update(){
+    if(!stdio_usb_connected()){
+        remote_synced = false; // Everything is sent again on connection
+        return;
+    }
+    for(uint8_t i = 0; i < TELEMETRY_FIELDS; i++){
+        uint16_t value = remote_field(i);
+        if(remote_synced && value == remote_sent[i]){ continue; }
+        remote_send(TELEMETRY_FIRST + i, value);
+        remote_sent[i] = value;
+    }
+    remote_synced = true;
 }
+#endif
 
 int main(){
+    set_sys_clock_khz(RUN_CLOCK_KHZ, true);
     stdio_init_all();
     #if DEBUG
     stdio_usb_init();
     #endif
     bi_decl_all();
+    timer_init();
+    #if TRACK_INDEX_IN_RAM
+    track_index_init();
+    #endif
+
+    // Nothing below waits: commands to the player are queued until it
+    // reports that it is ready, so the keypad works right away.
+    state_restore();
+    stats_restore();
 
     // Use the onboard LED as a power-on indicator
     gpio_init(POWER_ON_LED_PIN);
     gpio_set_dir(POWER_ON_LED_PIN, GPIO_OUT);
     gpio_put(POWER_ON_LED_PIN, 1);
-    power_on_alarm = add_alarm_in_ms(500, power_on_complete, NULL, true);
-
-    gpio_init(LED_PIN);
-    gpio_set_dir(LED_PIN, GPIO_OUT);
-
-    button_t *play_button = create_button(BUTTON_1_PIN, button_onchange);
+    timer_arm(TIMER_POWER_ON, power_on_complete, 500 * 1000);
 
-    adc_init(); // Initialize the ADC for battery level monitoring
-    battery_check_init(5000, NULL, battery_low_callback);
+    gpio_set_function(LED_PIN, GPIO_FUNC_PWM);
+    pwm_set_wrap(pwm_gpio_to_slice_num(LED_PIN), 254); // Levels 0 to 255, full on at 255
+    pwm_set_gpio_level(LED_PIN, 0);
+    pwm_set_enabled(pwm_gpio_to_slice_num(LED_PIN), true);
 
-    gpio_init(BUSY_PIN);
-    gpio_set_dir(BUSY_PIN, GPIO_IN);
+    gpio_set_function(BUZZER_PIN, GPIO_FUNC_PWM);
+    buzzer_set(0);
 
     // Initialize the keypad with column and row configuration
     // And declare the number of columns and rows of the keypad
     keypad_init(&keypad, cols, rows, 5, 4);
 
-    // Assign the callbacks for each keypad event
-    keypad_on_press(&keypad, key_pressed);
-    keypad_on_long_press(&keypad, key_long_pressed);
+    // Assign the callbacks for each keypad event. They only queue the key,
+    // which is then handled by the main loop.
+    keypad_on_press(&keypad, on_key_press);
+    keypad_on_long_press(&keypad, on_key_long_press);
 
-    dfplayer_init(&dfplayer, DFPLAYER_UART, GPIO_TX, GPIO_RX);
-    sleep_ms(200); // Wait 200ms between commands to the player
-    
-    // Accepted volume values are 1 to 30.
+    // The keypad is scanned in the background, so that the scan interval
+    // does not depend on what the main loop is doing
+    timer_arm(TIMER_KEYPAD, keypad_scan, KEYPAD_SCAN_MS * 1000);
+    #if BENCHMARK
+    timer_arm(TIMER_BENCHMARK, bench_tick, BENCHMARK_INTERVAL_MS * 1000);
+    #endif
+    #if DEBUG
+    printf("Keypad ready after %uus\n", (unsigned int)time_us_64());
+    #endif
+
+    // The rows also wake the system from the low-power idle mode
+    uint32_t row_mask = 0;
+    for(uint8_t i = 0; i < sizeof(rows); i++){ row_mask |= 1u << rows[i]; }
+    gpio_add_raw_irq_handler_masked(row_mask, keypad_wake_handler);
+    irq_set_enabled(IO_IRQ_BANK0, true);
+
+    create_button(BUTTON_1_PIN, button_onchange); // Handled by button_onchange()
+
+    battery_init();
+
+    // The player engine runs on core 1
+    multicore_launch_core1(player_core_main);
+
+    // Accepted volume values are 0 to 30.
     // Be careful, as it can get dangerously loud for a headset.
-    dfplayer_set_volume(&dfplayer, 1);
+    player_request(VOLUME);
+    if(eq){ player_request(EQ); }
+    player_request(FILE_COUNT); // Tracks beyond the count are skipped
 
     blink(BLINK_DURATION_MS); // Feedback blink
-    
-    tone_init(&generator, BUZZER_PIN);
-
-    add_repeating_timer_ms(PLAYER_POLL_MS, poll_player, NULL, &status_timer);
 
     while (true){
-        keypad_read(&keypad);
-        sleep_ms(10);
+        power_update();
+        handle_player_notifications();
+        handle_key_events();
+        playlist_update();
+        arm_next_track();
+        battery_update();
+        state_update();
+        stats_update();
+        #if REMOTE
+        remote_poll();
+        remote_update();
+        #endif
+        #if TRACE
+        trace_drain();
+        #endif
+        #if BENCHMARK
+        bench_report();
+        #endif
+        __wfe(); // Sleep until the next interrupt or key event
     }
 
     return 0;
 }
-
@@ -0,0 +1,10 @@
+#ifndef MOCK_BUTTON_H_
+#define MOCK_BUTTON_H_
+#include <stdint.h>
+#include <stdbool.h>
+typedef struct button_t {
+    uint8_t pin;
+    bool state;
+} button_t;
+button_t *create_button(int pin, void (*onchange)(button_t *button));
+#endif
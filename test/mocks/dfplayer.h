@@ -0,0 +1,6 @@
+#ifndef MOCK_DFPLAYER_H_
+#define MOCK_DFPLAYER_H_
+#include "pico/stdlib.h"
+typedef struct { uart_inst_t *uart; } dfplayer_t;
+void dfplayer_init(dfplayer_t *dfplayer, uart_inst_t *uart, uint8_t gpio_tx, uint8_t gpio_rx);
+#endif
@@ -0,0 +1,12 @@
+#ifndef MOCK_HARDWARE_CLOCKS_H_
+#define MOCK_HARDWARE_CLOCKS_H_
+#include <stdint.h>
+#include <stdbool.h>
+enum clock_index { clk_gpout0, clk_gpout1, clk_gpout2, clk_gpout3, clk_ref, clk_sys, clk_peri };
+#define CLOCKS_CLK_SYS_CTRL_SRC_VALUE_CLKSRC_CLK_SYS_AUX    1
+#define CLOCKS_CLK_SYS_CTRL_AUXSRC_VALUE_CLKSRC_PLL_SYS     0
+#define CLOCKS_CLK_PERI_CTRL_AUXSRC_VALUE_CLK_SYS           0
+bool set_sys_clock_khz(uint32_t freq_khz, bool required);
+bool clock_configure(enum clock_index clock, uint32_t src, uint32_t auxsrc, uint32_t src_freq, uint32_t freq);
+uint32_t clock_get_hz(enum clock_index clock);
+#endif
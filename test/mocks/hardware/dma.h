@@ -0,0 +1,22 @@
+#ifndef MOCK_HARDWARE_DMA_H_
+#define MOCK_HARDWARE_DMA_H_
+#include "pico/stdlib.h"
+#define DMA_SIZE_16             1
+#define DMA_IRQ_0               11
+#define PICO_SHARED_IRQ_HANDLER_DEFAULT_ORDER_PRIORITY 128
+typedef struct { int unused; } dma_channel_config;
+int dma_claim_unused_channel(bool required);
+dma_channel_config dma_channel_get_default_config(uint channel);
+void channel_config_set_transfer_data_size(dma_channel_config *c, int size);
+void channel_config_set_read_increment(dma_channel_config *c, bool incr);
+void channel_config_set_write_increment(dma_channel_config *c, bool incr);
+void channel_config_set_dreq(dma_channel_config *c, uint dreq);
+void dma_channel_configure(uint channel, const dma_channel_config *config, volatile void *write_addr,
+    const volatile void *read_addr, uint transfer_count, bool trigger);
+void dma_channel_set_irq0_enabled(uint channel, bool enabled);
+void dma_channel_set_write_addr(uint channel, volatile void *write_addr, bool trigger);
+void dma_channel_set_trans_count(uint channel, uint32_t trans_count, bool trigger);
+bool dma_channel_is_busy(uint channel);
+bool dma_channel_get_irq0_status(uint channel);
+void dma_channel_acknowledge_irq0(uint channel);
+#endif
@@ -0,0 +1,11 @@
+#ifndef MOCK_HARDWARE_FLASH_H_
+#define MOCK_HARDWARE_FLASH_H_
+#include <stdint.h>
+#include <stddef.h>
+#define FLASH_SECTOR_SIZE       4096u
+#define FLASH_PAGE_SIZE         256u
+extern uint8_t mock_flash[];    // PICO_FLASH_SIZE_BYTES, memory mapped at XIP_BASE
+#define XIP_BASE                ((uintptr_t)mock_flash)
+void flash_range_erase(uint32_t offset, size_t count);
+void flash_range_program(uint32_t offset, const uint8_t *data, size_t count);
+#endif
@@ -0,0 +1,9 @@
+#ifndef MOCK_HARDWARE_PWM_H_
+#define MOCK_HARDWARE_PWM_H_
+#include "pico/stdlib.h"
+uint pwm_gpio_to_slice_num(uint gpio);
+void pwm_set_gpio_level(uint gpio, uint16_t level);
+void pwm_set_enabled(uint slice, bool enabled);
+void pwm_set_clkdiv_int_frac(uint slice, uint8_t integer, uint8_t fract);
+void pwm_set_wrap(uint slice, uint16_t wrap);
+#endif
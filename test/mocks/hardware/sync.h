@@ -0,0 +1,4 @@
+#ifndef MOCK_HARDWARE_SYNC_H_
+#define MOCK_HARDWARE_SYNC_H_
+#include "pico/stdlib.h"
+#endif
@@ -0,0 +1,8 @@
+#ifndef MOCK_HARDWARE_TIMER_H_
+#define MOCK_HARDWARE_TIMER_H_
+#include "pico/stdlib.h"
+int hardware_alarm_claim_unused(bool required);
+void hardware_alarm_set_callback(uint alarm, void (*callback)(uint alarm));
+bool hardware_alarm_set_target(uint alarm, absolute_time_t target);
+void hardware_alarm_cancel(uint alarm);
+#endif
@@ -0,0 +1,12 @@
+#ifndef MOCK_KEYPAD_H_
+#define MOCK_KEYPAD_H_
+#include <stdint.h>
+typedef struct {
+    void (*on_press)(uint8_t key);
+    void (*on_long_press)(uint8_t key);
+} KeypadMatrix;
+void keypad_init(KeypadMatrix *keypad, const uint8_t *cols, const uint8_t *rows, uint8_t num_cols, uint8_t num_rows);
+void keypad_on_press(KeypadMatrix *keypad, void (*callback)(uint8_t key));
+void keypad_on_long_press(KeypadMatrix *keypad, void (*callback)(uint8_t key));
+void keypad_read(KeypadMatrix *keypad);
+#endif
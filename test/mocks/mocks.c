@@ -0,0 +1,320 @@
+/**
+ * @file mocks.c
+ * @brief Host implementation of the SDK and library calls used by the firmware
+ */
+// Both cores run on one thread: the test drives the loops of core 0 and
+// core 1 itself, and the interrupt handlers run when the clock or a pin
+// says they would. Time only moves through mock_advance_us() and the busy waits.
+#include <string.h>
+#include "mocks.h"
+#include "hardware/adc.h"
+#include "hardware/clocks.h"
+#include "hardware/dma.h"
+#include "hardware/flash.h"
+#include "hardware/pwm.h"
+#include "hardware/timer.h"
+#include "pico/flash.h"
+#include "pico/multicore.h"
+#include "pico/rand.h"
+#include "button.h"
+#include "dfplayer.h"
+#include "keypad.h"
+
+#define FRAME_SIZE              10
+
+mock_frame_t mock_frames[MOCK_FRAMES_MAX];
+uint32_t mock_frame_count;
+void (*mock_uart_tx_hook)(const mock_frame_t *frame);
+unsigned mock_core;
+uint32_t mock_clock_khz = SYS_CLK_KHZ;
+unsigned mock_clock_core;
+int mock_flash_result = PICO_OK;
+
+uint8_t mock_flash[PICO_FLASH_SIZE_BYTES];
+
+static uint64_t sim_time;
+
+static void (*alarm_callback)(uint alarm);
+static uint64_t alarm_target;
+static bool alarm_armed;
+static bool in_alarm;           // The alarm does not nest: a busy wait in it lets time pass only
+
+static bool gpio_level[32];
+static uint32_t gpio_events[32];
+static void (*gpio_handler[32])(void);
+static void (*uart_handler)(void);
+
+static uint8_t uart_rx[256];
+static uint16_t uart_rx_head, uart_rx_tail;
+
+static adc_hw_t adc_regs;
+adc_hw_t *adc_hw = &adc_regs;
+
+static struct uart_inst { int index; } uart1_regs = {1};
+uart_inst_t *uart1_inst = &uart1_regs;
+
+/**
+ * @brief Reset the simulation: time 0, erased flash, pins low
+ */
+void mock_init(void){
+    sim_time = 0;
+    alarm_armed = false;
+    in_alarm = false;
+    memset(mock_flash, 0xFF, sizeof(mock_flash));
+    memset(gpio_level, 0, sizeof(gpio_level));
+    memset(gpio_events, 0, sizeof(gpio_events));
+    uart_rx_head = uart_rx_tail = 0;
+    mock_frame_count = 0;
+    mock_core = 0;
+}
+
+/**
+ * @brief Time the hardware alarm fires
+ * @return Time in microseconds, or UINT64_MAX if it is not armed
+ */
+uint64_t mock_next_alarm(void){
+    return alarm_armed ? alarm_target : UINT64_MAX;
+}
+
+/**
+ * @brief Move the virtual clock forward, firing the hardware alarm on its way
+ * @param us Microseconds
+ */
+void mock_advance_us(uint64_t us){
+    uint64_t end = sim_time + us;
+    while(!in_alarm && alarm_armed && alarm_target <= end){
+        if(alarm_target > sim_time){ sim_time = alarm_target; }
+        alarm_armed = false;
+        unsigned core = mock_core;
+        mock_core = 0; // The alarm is claimed by core 0
+        in_alarm = true;
+        alarm_callback(0);
+        in_alarm = false;
+        mock_core = core;
+    }
+    sim_time = MAX(sim_time, end);
+}
+
+/**
+ * @brief Drive an input pin, running its edge interrupt
+ * @param gpio Pin
+ * @param value Level
+ */
+void mock_gpio_set(uint gpio, bool value){
+    if(gpio_level[gpio] == value){ return; }
+    gpio_level[gpio] = value;
+    gpio_events[gpio] |= value ? GPIO_IRQ_EDGE_RISE : GPIO_IRQ_EDGE_FALL;
+    if(gpio_handler[gpio]){
+        unsigned core = mock_core;
+        mock_core = 1; // Only the BUSY pin is simulated, and core 1 handles it
+        gpio_handler[gpio]();
+        mock_core = core;
+    }
+}
+
+/**
+ * @brief Receive bytes from the player, running the UART interrupt
+ * @param data Bytes
+ * @param length Number of bytes
+ */
+void mock_uart_rx(const uint8_t *data, size_t length){
+    for(size_t i = 0; i < length; i++){ uart_rx[uart_rx_head++ & 0xFF] = data[i]; }
+    if(uart_handler){
+        unsigned core = mock_core;
+        mock_core = 1;
+        uart_handler();
+        mock_core = core;
+    }
+}
+
+// Time
+
+uint64_t time_us_64(void){ return sim_time; }
+uint32_t time_us_32(void){ return (uint32_t)sim_time; }
+absolute_time_t get_absolute_time(void){ return sim_time; }
+absolute_time_t from_us_since_boot(uint64_t us){ return us; }
+uint64_t to_us_since_boot(absolute_time_t t){ return t; }
+uint32_t to_ms_since_boot(absolute_time_t t){ return (uint32_t)(t / 1000); }
+void busy_wait_us_32(uint32_t us){ mock_advance_us(us); }
+void busy_wait_ms(uint32_t ms){ mock_advance_us(ms * 1000ULL); }
+void sleep_ms(uint32_t ms){ mock_advance_us(ms * 1000ULL); }
+bool best_effort_wfe_or_timeout(absolute_time_t t){ (void)t; return false; }
+
+// Synchronization
+
+uint32_t save_and_disable_interrupts(void){ return 0; }
+void restore_interrupts(uint32_t status){ (void)status; }
+void __wfe(void){}
+void __sev(void){}
+void __dmb(void){}
+
+// GPIO
+
+void gpio_init(uint gpio){ (void)gpio; }
+void gpio_set_dir(uint gpio, bool out){ (void)gpio; (void)out; }
+void gpio_put(uint gpio, bool value){ gpio_level[gpio] = value; }
+bool gpio_get(uint gpio){ return gpio_level[gpio]; }
+void gpio_pull_up(uint gpio){ (void)gpio; }
+void gpio_pull_down(uint gpio){ (void)gpio; }
+void gpio_set_function(uint gpio, int function){ (void)gpio; (void)function; }
+void gpio_set_irq_enabled(uint gpio, uint32_t events, bool enabled){ (void)gpio; (void)events; (void)enabled; }
+void gpio_add_raw_irq_handler(uint gpio, void (*handler)(void)){ gpio_handler[gpio] = handler; }
+void gpio_add_raw_irq_handler_masked(uint32_t mask, void (*handler)(void)){ (void)mask; (void)handler; }
+void gpio_acknowledge_irq(uint gpio, uint32_t events){ gpio_events[gpio] &= ~events; }
+uint32_t gpio_get_irq_event_mask(uint gpio){ return gpio_events[gpio]; }
+
+// IRQ
+
+void irq_set_enabled(uint irq, bool enabled){ (void)irq; (void)enabled; }
+void irq_set_exclusive_handler(uint irq, void (*handler)(void)){
+    if(irq == UART1_IRQ){ uart_handler = handler; }
+}
+void irq_add_shared_handler(uint irq, void (*handler)(void), uint8_t priority){
+    (void)irq; (void)handler; (void)priority;
+}
+
+// UART: the frames written are decoded for the test
+
+bool uart_is_readable(uart_inst_t *uart){ (void)uart; return uart_rx_tail != uart_rx_head; }
+char uart_getc(uart_inst_t *uart){ (void)uart; return uart_rx[uart_rx_tail++ & 0xFF]; }
+uint uart_get_index(uart_inst_t *uart){ return uart->index; }
+void uart_set_irq_enables(uart_inst_t *uart, bool rx, bool tx){ (void)uart; (void)rx; (void)tx; }
+uint uart_set_baudrate(uart_inst_t *uart, uint baudrate){ (void)uart; return baudrate; }
+void uart_tx_wait_blocking(uart_inst_t *uart){ (void)uart; }
+
+void uart_write_blocking(uart_inst_t *uart, const uint8_t *src, size_t len){
+    (void)uart;
+    mock_frame_t frame = {sim_time, src[3], (uint16_t)((src[5] << 8) | src[6]), len == FRAME_SIZE};
+    mock_frames[mock_frame_count++ % MOCK_FRAMES_MAX] = frame;
+    if(mock_uart_tx_hook){ mock_uart_tx_hook(&frame); }
+    sim_time += len * 1000 + 1; // About 1ms per byte at 9600 baud
+}
+
+// Standard I/O: no host is connected
+
+void stdio_init_all(void){}
+bool stdio_usb_init(void){ return true; }
+bool stdio_usb_connected(void){ return false; }
+int getchar_timeout_us(uint32_t timeout_us){ (void)timeout_us; return PICO_ERROR_TIMEOUT; }
+int putchar_raw(int c){ return c; }
+
+// Hardware alarm
+
+int hardware_alarm_claim_unused(bool required){ (void)required; return 0; }
+void hardware_alarm_set_callback(uint alarm, void (*callback)(uint alarm)){ (void)alarm; alarm_callback = callback; }
+void hardware_alarm_cancel(uint alarm){ (void)alarm; alarm_armed = false; }
+
+/**
+ * @brief Arm the hardware alarm
+ * @return True if the target has already passed, as the SDK does
+ */
+bool hardware_alarm_set_target(uint alarm, absolute_time_t target){
+    (void)alarm;
+    if(target <= sim_time){ return true; }
+    alarm_target = target;
+    alarm_armed = true;
+    return false;
+}
+
+// Clocks
+
+bool set_sys_clock_khz(uint32_t freq_khz, bool required){
+    (void)required;
+    mock_clock_khz = freq_khz;
+    mock_clock_core = mock_core;
+    return true;
+}
+bool clock_configure(enum clock_index clock, uint32_t src, uint32_t auxsrc, uint32_t src_freq, uint32_t freq){
+    (void)src; (void)auxsrc; (void)src_freq;
+    if(clock == clk_sys){
+        mock_clock_khz = freq / 1000;
+        mock_clock_core = mock_core;
+    }
+    return true;
+}
+uint32_t clock_get_hz(enum clock_index clock){ (void)clock; return SYS_CLK_KHZ * 1000; }
+
+// Flash, memory mapped at XIP_BASE
+
+void flash_range_erase(uint32_t offset, size_t count){ memset(mock_flash + offset, 0xFF, count); }
+void flash_range_program(uint32_t offset, const uint8_t *data, size_t count){
+    for(size_t i = 0; i < count; i++){ mock_flash[offset + i] &= data[i]; }
+}
+int flash_safe_execute(void (*func)(void *), void *param, uint32_t enter_exit_timeout_ms){
+    (void)enter_exit_timeout_ms;
+    if(mock_flash_result == PICO_OK){ func(param); }
+    return mock_flash_result;
+}
+
+// Multicore: the test runs the loop of core 1 itself
+
+void multicore_launch_core1(void (*entry)(void)){ (void)entry; }
+void multicore_lockout_victim_init(void){}
+void multicore_lockout_start_blocking(void){}
+void multicore_lockout_end_blocking(void){}
+unsigned get_core_num(void){ return mock_core; }
+
+uint64_t get_rand_64(void){ return 0x0123456789ABCDEFULL; }
+
+// ADC and DMA: the battery reads as full
+
+void adc_init(void){}
+void adc_gpio_init(uint gpio){ (void)gpio; }
+void adc_select_input(uint input){ (void)input; }
+void adc_fifo_setup(bool en, bool dreq_en, uint16_t dreq_thresh, bool err_in_fifo, bool byte_shift){
+    (void)en; (void)dreq_en; (void)dreq_thresh; (void)err_in_fifo; (void)byte_shift;
+}
+void adc_set_clkdiv(float clkdiv){ (void)clkdiv; }
+void adc_run(bool run){ (void)run; }
+void adc_fifo_drain(void){}
+
+int dma_claim_unused_channel(bool required){ (void)required; return 0; }
+dma_channel_config dma_channel_get_default_config(uint channel){ (void)channel; return (dma_channel_config){0}; }
+void channel_config_set_transfer_data_size(dma_channel_config *c, int size){ (void)c; (void)size; }
+void channel_config_set_read_increment(dma_channel_config *c, bool incr){ (void)c; (void)incr; }
+void channel_config_set_write_increment(dma_channel_config *c, bool incr){ (void)c; (void)incr; }
+void channel_config_set_dreq(dma_channel_config *c, uint dreq){ (void)c; (void)dreq; }
+void dma_channel_configure(uint channel, const dma_channel_config *config, volatile void *write_addr,
+    const volatile void *read_addr, uint transfer_count, bool trigger){
+    (void)channel; (void)config; (void)write_addr; (void)read_addr; (void)transfer_count; (void)trigger;
+}
+void dma_channel_set_irq0_enabled(uint channel, bool enabled){ (void)channel; (void)enabled; }
+void dma_channel_set_write_addr(uint channel, volatile void *write_addr, bool trigger){
+    (void)channel; (void)write_addr; (void)trigger;
+}
+void dma_channel_set_trans_count(uint channel, uint32_t trans_count, bool trigger){
+    (void)channel; (void)trans_count; (void)trigger;
+}
+bool dma_channel_is_busy(uint channel){ (void)channel; return true; }
+bool dma_channel_get_irq0_status(uint channel){ (void)channel; return false; }
+void dma_channel_acknowledge_irq0(uint channel){ (void)channel; }
+
+// PWM
+
+uint pwm_gpio_to_slice_num(uint gpio){ return (gpio >> 1) & 7; }
+void pwm_set_gpio_level(uint gpio, uint16_t level){ (void)gpio; (void)level; }
+void pwm_set_enabled(uint slice, bool enabled){ (void)slice; (void)enabled; }
+void pwm_set_clkdiv_int_frac(uint slice, uint8_t integer, uint8_t fract){ (void)slice; (void)integer; (void)fract; }
+void pwm_set_wrap(uint slice, uint16_t wrap){ (void)slice; (void)wrap; }
+
+// Libraries
+
+void dfplayer_init(dfplayer_t *dfplayer, uart_inst_t *uart, uint8_t gpio_tx, uint8_t gpio_rx){
+    (void)gpio_tx; (void)gpio_rx;
+    dfplayer->uart = uart;
+}
+
+void keypad_init(KeypadMatrix *keypad, const uint8_t *cols, const uint8_t *rows, uint8_t num_cols, uint8_t num_rows){
+    (void)cols; (void)rows; (void)num_cols; (void)num_rows;
+    memset(keypad, 0, sizeof(*keypad));
+}
+void keypad_on_press(KeypadMatrix *keypad, void (*callback)(uint8_t key)){ keypad->on_press = callback; }
+void keypad_on_long_press(KeypadMatrix *keypad, void (*callback)(uint8_t key)){ keypad->on_long_press = callback; }
+void keypad_read(KeypadMatrix *keypad){ (void)keypad; }
+
+button_t *create_button(int pin, void (*onchange)(button_t *button)){
+    (void)onchange;
+    static button_t button;
+    button.pin = pin;
+    return &button;
+}
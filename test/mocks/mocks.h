@@ -0,0 +1,55 @@
+/**
+ * @file mocks.h
+ * @brief Controls of the host simulation: virtual clock, pins, UART and flash
+ */
+#ifndef MOCKS_H_
+#define MOCKS_H_
+
+#include "pico/stdlib.h"
+
+/**
+ * @brief A frame written to the player UART
+ */
+typedef struct {
+    uint64_t time_us;
+    uint8_t cmd;
+    uint16_t arg;
+    bool checksum;
+} mock_frame_t;
+
+#define MOCK_FRAMES_MAX         1024    // Must be a power of two
+
+/**
+ * @brief Last frames written to the player UART, frame n at n % MOCK_FRAMES_MAX
+ */
+extern mock_frame_t mock_frames[MOCK_FRAMES_MAX];
+extern uint32_t mock_frame_count;
+
+/**
+ * @brief Called for each frame written to the player UART, to model the player
+ */
+extern void (*mock_uart_tx_hook)(const mock_frame_t *frame);
+
+/**
+ * @brief Core reported by get_core_num()
+ */
+extern unsigned mock_core;
+
+/**
+ * @brief Last system clock set in kHz, and the core that set it
+ */
+extern uint32_t mock_clock_khz;
+extern unsigned mock_clock_core;
+
+/**
+ * @brief Result of flash_safe_execute(), which only runs the function on PICO_OK
+ */
+extern int mock_flash_result;
+
+void mock_init(void);
+void mock_advance_us(uint64_t us);
+uint64_t mock_next_alarm(void);
+void mock_gpio_set(uint gpio, bool value);
+void mock_uart_rx(const uint8_t *data, size_t length);
+
+#endif
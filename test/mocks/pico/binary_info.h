@@ -0,0 +1,3 @@
+#ifndef MOCK_PICO_BINARY_INFO_H_
+#define MOCK_PICO_BINARY_INFO_H_
+#endif
@@ -0,0 +1,5 @@
+#ifndef MOCK_PICO_FLASH_H_
+#define MOCK_PICO_FLASH_H_
+#include <stdint.h>
+int flash_safe_execute(void (*func)(void *), void *param, uint32_t enter_exit_timeout_ms);
+#endif
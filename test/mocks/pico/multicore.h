@@ -0,0 +1,9 @@
+#ifndef MOCK_PICO_MULTICORE_H_
+#define MOCK_PICO_MULTICORE_H_
+#include <stdbool.h>
+void multicore_launch_core1(void (*entry)(void));
+void multicore_lockout_victim_init(void);
+void multicore_lockout_start_blocking(void);
+void multicore_lockout_end_blocking(void);
+unsigned get_core_num(void);
+#endif
@@ -0,0 +1,5 @@
+#ifndef MOCK_PICO_RAND_H_
+#define MOCK_PICO_RAND_H_
+#include <stdint.h>
+uint64_t get_rand_64(void);
+#endif
@@ -0,0 +1,3 @@
+#ifndef MOCK_PICO_STDIO_H_
+#define MOCK_PICO_STDIO_H_
+#endif
@@ -0,0 +1,93 @@
+/**
+ * @file stdlib.h
+ * @brief Host stand-in for the Pico SDK: time runs on the virtual clock of mocks.c
+ */
+#ifndef MOCK_PICO_STDLIB_H_
+#define MOCK_PICO_STDLIB_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef unsigned int uint;
+typedef uint64_t absolute_time_t;
+
+#define PICO_ERROR_TIMEOUT      (-1)
+#define PICO_OK                 0
+#define PICO_DEFAULT_LED_PIN    25
+#define PICO_FLASH_SIZE_BYTES   (64 * 1024)
+#define SYS_CLK_KHZ             125000
+
+#define __not_in_flash_func(f)  f
+#define count_of(a)             (sizeof(a) / sizeof((a)[0]))
+#define MIN(a, b)               ((a) < (b) ? (a) : (b))
+#define MAX(a, b)               ((a) > (b) ? (a) : (b))
+
+// Time
+uint64_t time_us_64(void);
+uint32_t time_us_32(void);
+absolute_time_t get_absolute_time(void);
+absolute_time_t from_us_since_boot(uint64_t us);
+uint64_t to_us_since_boot(absolute_time_t t);
+uint32_t to_ms_since_boot(absolute_time_t t);
+void busy_wait_us_32(uint32_t us);
+void busy_wait_ms(uint32_t ms);
+void sleep_ms(uint32_t ms);
+bool best_effort_wfe_or_timeout(absolute_time_t t);
+
+// Synchronization: the simulation runs both cores on one thread
+uint32_t save_and_disable_interrupts(void);
+void restore_interrupts(uint32_t status);
+void __wfe(void);
+void __sev(void);
+void __dmb(void);
+
+// GPIO
+#define GPIO_OUT                1
+#define GPIO_IN                 0
+#define GPIO_FUNC_PWM           4
+#define GPIO_IRQ_LEVEL_LOW      1u
+#define GPIO_IRQ_LEVEL_HIGH     2u
+#define GPIO_IRQ_EDGE_FALL      4u
+#define GPIO_IRQ_EDGE_RISE      8u
+#define IO_IRQ_BANK0            13
+void gpio_init(uint gpio);
+void gpio_set_dir(uint gpio, bool out);
+void gpio_put(uint gpio, bool value);
+bool gpio_get(uint gpio);
+void gpio_pull_up(uint gpio);
+void gpio_pull_down(uint gpio);
+void gpio_set_function(uint gpio, int function);
+void gpio_set_irq_enabled(uint gpio, uint32_t events, bool enabled);
+void gpio_add_raw_irq_handler(uint gpio, void (*handler)(void));
+void gpio_add_raw_irq_handler_masked(uint32_t mask, void (*handler)(void));
+void gpio_acknowledge_irq(uint gpio, uint32_t events);
+uint32_t gpio_get_irq_event_mask(uint gpio);
+
+// IRQ
+#define UART0_IRQ               20
+#define UART1_IRQ               21
+void irq_set_enabled(uint irq, bool enabled);
+void irq_set_exclusive_handler(uint irq, void (*handler)(void));
+void irq_add_shared_handler(uint irq, void (*handler)(void), uint8_t priority);
+
+// UART
+typedef struct uart_inst uart_inst_t;
+extern uart_inst_t *uart1_inst;
+#define uart1                   uart1_inst
+bool uart_is_readable(uart_inst_t *uart);
+char uart_getc(uart_inst_t *uart);
+uint uart_get_index(uart_inst_t *uart);
+void uart_set_irq_enables(uart_inst_t *uart, bool rx, bool tx);
+uint uart_set_baudrate(uart_inst_t *uart, uint baudrate);
+void uart_write_blocking(uart_inst_t *uart, const uint8_t *src, size_t len);
+void uart_tx_wait_blocking(uart_inst_t *uart);
+
+// Standard I/O
+void stdio_init_all(void);
+bool stdio_usb_init(void);
+bool stdio_usb_connected(void);
+int getchar_timeout_us(uint32_t timeout_us);
+int putchar_raw(int c);
+
+#endif
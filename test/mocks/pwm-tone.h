@@ -0,0 +1,11 @@
+#ifndef MOCK_PWM_TONE_H_
+#define MOCK_PWM_TONE_H_
+#include <stdint.h>
+struct note_t {
+    int freq;
+    int measure;
+};
+enum { REST = 0, MELODY_END = -1, NOTE_C3 = 131, NOTE_C4 = 262, NOTE_CS4 = 277, NOTE_D4 = 294,
+    NOTE_DS4 = 311, NOTE_E4 = 330, NOTE_F4 = 349, NOTE_FS4 = 370, NOTE_G4 = 392, NOTE_GS4 = 415,
+    NOTE_A4 = 440, NOTE_AS4 = 466, NOTE_B4 = 494, NOTE_C5 = 523, NOTE_D5 = 587 };
+#endif
@@ -0,0 +1,842 @@
+/**
+ * @file sim.c
+ * @brief Simulated sessions of the firmware on the host, against a modelled DFPlayer
+ */
+// The firmware is built as part of this file, so that the sessions can look
+// at its state. Each step of the virtual clock runs the interrupts that are
+// due, one pass of the core 1 loop and one pass of the core 0 loop. Steps go
+// from one deadline to the next, as the cores would sleep in between.
+#define main jukephone_main
+#include "../main.c"
+#undef main
+
+#include <string.h>
+#include <time.h>
+#include "mocks.h"
+
+#define STEP_US                 100     // Shortest step of the clock
+#define REPLY_DELAY_MS          20      // Replies under PLAYER_PROBE_FAST_MS pick PROFILE_FAST
+#define SIM_FILE_COUNT          50
+#define SIM_SESSIONS            1000    // Random sessions, each with its own seed
+#define SIM_BURSTS              20      // Bursts of requests per random session
+#define SIM_BURST_MAX           40      // Requests per burst, under TRACE_BUFFER_SIZE records
+#define SIM_KEYS                60      // Key presses per random session, at a human rate
+
+static int failures;
+
+#define CHECK(condition) do { if(!(condition)){ \
+    printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); failures++; } } while(0)
+
+/**
+ * @brief Modelled player: replies still to be sent, and the track being played
+ */
+typedef struct {
+    uint64_t due_us;
+    uint8_t cmd;
+    uint16_t arg;
+    bool bad_checksum;
+} reply_t;
+
+static reply_t replies[16];
+static uint8_t reply_count;
+static bool model_playing;
+static uint64_t model_busy_at;  // Time the BUSY pin follows model_playing, 0 when it already does
+static bool model_frozen;       // Keeps playing whatever it is sent, so that no track ends
+static bool model_strict_rx;    // Ignores the frames sent with a checksum
+static bool model_bad_tx;       // Gets the checksum of all its frames wrong
+
+/**
+ * @brief Trace records tallied by core, event and argument, see trace_tally()
+ */
+static uint32_t traced[2][32][256];
+
+static uint32_t rng_state;
+
+/**
+ * @brief Queue a frame for the player to send
+ * @param delay_ms Delay from now
+ * @param cmd Frame command
+ * @param arg Frame argument
+ */
+static void model_reply(uint32_t delay_ms, uint8_t cmd, uint16_t arg){
+    if(reply_count < count_of(replies)){
+        replies[reply_count++] = (reply_t){time_us_64() + delay_ms * 1000, cmd, arg, false};
+    }
+}
+
+/**
+ * @brief Act on a frame sent to the player
+ * @param frame Frame
+ */
+static void model_receive(const mock_frame_t *frame){
+    if(model_strict_rx && frame->checksum){ return; }
+    switch(frame->cmd){
+        case FRAME_STATUS:
+            model_reply(REPLY_DELAY_MS, FRAME_STATUS, model_playing ? 1 : 0);
+        break;
+        case FRAME_FILE_COUNT:
+            model_reply(REPLY_DELAY_MS, FRAME_FILE_COUNT, SIM_FILE_COUNT);
+        break;
+        case FRAME_PLAY:
+        case FRAME_RESUME:
+            if(model_frozen){ break; }
+            model_playing = true;
+            model_busy_at = time_us_64() + 50 * 1000;
+        break;
+        case FRAME_PAUSE:
+            if(model_frozen){ break; }
+            model_playing = false;
+            model_busy_at = time_us_64() + 20 * 1000;
+        break;
+    }
+}
+
+/**
+ * @brief Send the frames of the player that are due, and update its BUSY pin
+ */
+static void model_step(){
+    for(uint8_t i = 0; i < reply_count; i++){
+        if(replies[i].due_us > time_us_64()){ continue; }
+        uint8_t frame[FRAME_SIZE] = {FRAME_START, FRAME_VERSION, FRAME_LENGTH, replies[i].cmd, 0,
+            replies[i].arg >> 8, replies[i].arg & 0xFF, 0, 0, FRAME_END};
+        uint16_t sum = 0;
+        for(uint8_t j = 1; j < 7; j++){ sum += frame[j]; }
+        sum = -sum + (replies[i].bad_checksum || model_bad_tx);
+        frame[7] = sum >> 8;
+        frame[8] = sum & 0xFF;
+        mock_uart_rx(frame, sizeof(frame));
+        replies[i--] = replies[--reply_count];
+    }
+    if(model_busy_at && time_us_64() >= model_busy_at){
+        model_busy_at = 0;
+        mock_gpio_set(BUSY_PIN, !model_playing); // BUSY is low while a track is playing
+    }
+}
+
+/**
+ * @brief Time the modelled player has something to do
+ * @return Time in microseconds, or UINT64_MAX if it has nothing to send
+ */
+static uint64_t model_next_due(){
+    uint64_t due = model_busy_at ? model_busy_at : UINT64_MAX;
+    for(uint8_t i = 0; i < reply_count; i++){ due = MIN(due, replies[i].due_us); }
+    return due;
+}
+
+/**
+ * @brief Move the trace records of both cores into traced[], as trace_drain() would
+ */
+static void trace_tally(){
+    for(uint8_t core = 0; core < 2; core++){
+        CHECK(trace_dropped[core] == 0);
+        for(; trace_tail[core] != trace_head[core]; trace_tail[core]++){
+            const trace_t *record = &trace_ring[core][trace_tail[core] & (TRACE_BUFFER_SIZE - 1)];
+            if(record->event < 32 && record->arg < 256){ traced[core][record->event][record->arg]++; }
+        }
+    }
+}
+
+/**
+ * @brief Count the trace records of an event on a core since the last trace_clear()
+ * @param core Core
+ * @param event One of the TRACE_ events
+ * @param arg Event argument, under 256
+ * @return Number of records
+ */
+static uint32_t trace_count(uint8_t core, uint8_t event, uint16_t arg){
+    trace_tally();
+    return traced[core][event][arg];
+}
+
+/**
+ * @brief Forget the trace records so far
+ */
+static void trace_clear(){
+    trace_tally();
+    memset(traced, 0, sizeof(traced));
+}
+
+/**
+ * @brief Run both cores for a while
+ * @param ms Duration in milliseconds
+ */
+static void run_ms(uint32_t ms){
+    uint64_t end = time_us_64() + ms * 1000ULL;
+    while(time_us_64() < end){
+        uint64_t now = time_us_64();
+        uint64_t next = MIN(MIN(player_next_deadline(), mock_next_alarm()), MIN(model_next_due(), end));
+        mock_advance_us(next > now + STEP_US ? next - now : STEP_US);
+        model_step();
+        mock_core = 1;
+        poll_player();
+        mock_core = 0;
+        handle_player_notifications();
+        handle_key_events();
+        playlist_update();
+        arm_next_track();
+        trace_tally(); // So that the trace ring never fills up
+    }
+}
+
+/**
+ * @brief Run both cores until the player engine has nothing left to send
+ * @param limit_ms Longest run in milliseconds
+ * @return True if it got there in time
+ */
+// A fade can hold a command back and add volume frames before and after it
+static bool run_until_sent(uint32_t limit_ms){
+    for(uint32_t ms = 0; ms < limit_ms; ms += 100){
+        if(player_queue_head == player_queue_tail && player_fade_command == STATUS
+            && !player_advance_track && (player_volume == volume || is_paused)){ return true; }
+        run_ms(100);
+    }
+    return false;
+}
+
+/**
+ * @brief A frame sent to the player
+ * @param index Number of the frame since boot, one of the last MOCK_FRAMES_MAX
+ * @return The frame
+ */
+static const mock_frame_t *frame_at(uint32_t index){
+    return &mock_frames[index & (MOCK_FRAMES_MAX - 1)];
+}
+
+/**
+ * @brief Count the frames of a command sent since a given frame
+ * @param since Number of the first frame
+ * @param cmd Frame command
+ * @return Number of frames
+ */
+static uint16_t frame_count(uint32_t since, uint8_t cmd){
+    uint16_t count = 0;
+    for(uint32_t i = since; i < mock_frame_count; i++){
+        if(frame_at(i)->cmd == cmd){ count++; }
+    }
+    return count;
+}
+
+/**
+ * @brief Last frame of a command sent since a given frame
+ * @param since Number of the first frame
+ * @param cmd Frame command
+ * @return The frame, or NULL if there is none
+ */
+static const mock_frame_t *frame_last(uint32_t since, uint8_t cmd){
+    const mock_frame_t *last = NULL;
+    for(uint32_t i = since; i < mock_frame_count; i++){
+        if(frame_at(i)->cmd == cmd){ last = frame_at(i); }
+    }
+    return last;
+}
+
+/**
+ * @brief Check that the frames sent since a given frame respect the minimum gap of the profile
+ * @param since Number of the first frame
+ * @return True if they do
+ */
+static bool frames_paced(uint32_t since){
+    for(uint32_t i = since + 1; i < mock_frame_count; i++){
+        if(frame_at(i)->time_us - frame_at(i - 1)->time_us < player_profile->min_gap_ms * 1000){ return false; }
+    }
+    return true;
+}
+
+/**
+ * @brief Pseudo-random number for the sessions, replayed by the same seed
+ * @param n Upper bound
+ * @return Number from 0 to n - 1
+ */
+static uint32_t sim_random(uint32_t n){
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 17;
+    rng_state ^= rng_state << 5;
+    return rng_state % n;
+}
+
+/**
+ * @brief Sum a play statistic over all the tracks
+ * @param skips True for the skips, false for the plays
+ * @return Sum
+ */
+static uint32_t stats_total(bool skips){
+    uint32_t total = 0;
+    for(uint16_t i = 0; i < NUM_TRACKS; i++){ total += skips ? stats.record.tracks[i].skips : stats.record.tracks[i].plays; }
+    return total;
+}
+
+/**
+ * @brief Press the key of a digit, as the keypad scan does
+ * @param n Digit
+ */
+static void dial(uint8_t n){
+    for(uint8_t key = 0; key < count_of(KEYMAP); key++){
+        if(KEYMAP[key].action == KEY_DIGIT && KEYMAP[key].arg == n){
+            on_key_press(key);
+            run_ms(KEYPAD_DEBOUNCE_US / 1000 + 100);
+            return;
+        }
+    }
+}
+
+/**
+ * @brief Boot as main() does, up to the point where the player has been probed
+ */
+static void session_boot(){
+    mock_init();
+    mock_uart_tx_hook = model_receive;
+    mock_gpio_set(BUSY_PIN, 1); // Idle
+    timer_init();
+    #if TRACK_INDEX_IN_RAM
+    track_index_init();
+    #endif
+    state_restore();
+    stats_restore();
+    mock_core = 1;
+    player_core_init();
+    mock_core = 0;
+    timer_arm(TIMER_KEYPAD, keypad_scan, KEYPAD_SCAN_MS * 1000);
+    player_request(VOLUME);
+    player_request(FILE_COUNT);
+
+    // Some clones get the checksum of their READY frame wrong: it still counts,
+    // and it does not make the replies to the probe look bad
+    run_ms(500);
+    CHECK(!player_ready);
+    CHECK(frame_count(0, FRAME_VOLUME) == 0); // Held until the player is ready
+    model_reply(0, FRAME_READY, 0);
+    replies[reply_count - 1].bad_checksum = true;
+    run_ms(1000);
+    CHECK(player_rx_bad_checksum == 1);
+    CHECK(player_ready);
+    CHECK(player_probed);
+    CHECK(player_profile == &PLAYER_PROFILES[PROFILE_FAST]);
+    CHECK(num_tracks == SIM_FILE_COUNT);
+    CHECK(player_queue_head == player_queue_tail);
+}
+
+/**
+ * @brief Several requests for the same value waiting in the queue go out as one frame
+ */
+static void session_coalescing(){
+    uint32_t since = mock_frame_count;
+    uint8_t start = volume;
+    trace_clear();
+    for(uint8_t i = 0; i < 5; i++){ volume_up(); }
+    CHECK(trace_count(0, TRACE_QUEUED, VOLUME) == 1);
+    run_ms(1000);
+    CHECK(frame_count(since, FRAME_VOLUME) == 1);
+    CHECK(frame_last(since, FRAME_VOLUME) && frame_last(since, FRAME_VOLUME)->arg == start + 5);
+
+    // The track typed last is the one played
+    since = mock_frame_count;
+    current_track = 3;
+    player_request(PLAY);
+    current_track = 7;
+    player_request(PLAY);
+    run_ms(1000);
+    CHECK(frame_count(since, FRAME_PLAY) == 1);
+    CHECK(frame_last(since, FRAME_PLAY) && frame_last(since, FRAME_PLAY)->arg == 7);
+    CHECK(frames_paced(since));
+}
+
+/**
+ * @brief Requests beyond the size of the queue are dropped, the others keep their order
+ */
+static void session_drops(){
+    // Paused, so that nothing fades
+    is_paused = true;
+    player_request(PAUSE);
+    run_ms(1000);
+
+    uint32_t since = mock_frame_count;
+    trace_clear();
+    for(uint8_t i = 0; i < PLAYER_QUEUE_SIZE + 4; i++){ player_request(i & 1 ? PAUSE : RESUME); }
+    CHECK(trace_count(0, TRACE_QUEUE_FULL, RESUME) + trace_count(0, TRACE_QUEUE_FULL, PAUSE) == 4);
+    run_ms(PLAYER_QUEUE_SIZE * player_profile->min_gap_ms + 1000);
+    CHECK(frame_count(since, FRAME_RESUME) == PLAYER_QUEUE_SIZE / 2);
+    CHECK(frame_count(since, FRAME_PAUSE) == PLAYER_QUEUE_SIZE / 2);
+    bool alternating = true;
+    for(uint32_t i = since, n = 0; i < mock_frame_count; i++){
+        uint8_t cmd = frame_at(i)->cmd;
+        if(cmd != FRAME_RESUME && cmd != FRAME_PAUSE){ continue; }
+        if(cmd != (n++ & 1 ? FRAME_PAUSE : FRAME_RESUME)){ alternating = false; }
+    }
+    CHECK(alternating);
+    CHECK(frames_paced(since));
+    is_paused = false;
+}
+
+/**
+ * @brief A dialed number is played after the timeout, or at once with the extra button
+ */
+// Both come from interrupts, and reach the playlist through the key event queue
+static void session_dialing(){
+    uint32_t since = mock_frame_count;
+    dial(4); // 40 is a valid track: the timeout decides
+    CHECK(frame_count(since, FRAME_PLAY) == 0);
+    CHECK(key_events_head == key_events_tail);
+    run_ms(INPUT_TIMEOUT_MS + 1000);
+    CHECK(current_track == 4);
+    CHECK(frame_last(since, FRAME_PLAY) && frame_last(since, FRAME_PLAY)->arg == 4);
+
+    since = mock_frame_count;
+    dial(2);
+    button_t button = {BUTTON_1_PIN, false};
+    button_onchange(&button);
+    CHECK(current_track != 2); // Handled by the main loop, not by the interrupt
+    run_ms(500);
+    CHECK(current_track == 2);
+    CHECK(!timer_armed(TIMER_INPUT));
+    run_ms(INPUT_TIMEOUT_MS + 1000);
+    CHECK(frame_count(since, FRAME_PLAY) == 1);
+    CHECK(frame_last(since, FRAME_PLAY) && frame_last(since, FRAME_PLAY)->arg == 2);
+}
+
+/**
+ * @brief Keypad actions from the host are checked before they run
+ */
+static void session_remote(){
+    remote_command(REMOTE_KEY, (KEY_VOLUMEUP_RAMP << 8) | 200);
+    CHECK(!timer_armed(TIMER_VOLUME_RAMP));
+    remote_command(REMOTE_KEY, (KEY_DIGIT << 8) | 12);
+    CHECK(track_id_prompt == 0);
+    remote_command(REMOTE_KEY, (KEY_DIGIT << 8) | 3);
+    CHECK(track_id_prompt == 3);
+    run_ms(INPUT_TIMEOUT_MS + 1000);
+    CHECK(current_track == 3);
+}
+
+/**
+ * @brief Holding a volume key ramps the volume, one step per event of the main loop
+ */
+// The ramp runs from the timer interrupt, and leaves the volume itself to the main loop
+static void session_ramp(){
+    uint8_t start = volume;
+    uint8_t key = 13; // Volume up, then ramp
+    uint8_t row = rows[key / sizeof(cols)];
+    mock_gpio_set(row, 1); // Held down
+    on_key_press(key);
+    on_key_long_press(key);
+    run_ms(10);
+    CHECK(volume == start + 1);
+    CHECK(timer_armed(TIMER_VOLUME_RAMP));
+    volume_ramp(); // As the timer does
+    CHECK(volume == start + 1);
+    CHECK(key_events_head != key_events_tail);
+    run_ms(10);
+    CHECK(volume == start + 2);
+    run_ms(VOLUME_RAMP_MS * 3 + 10);
+    mock_gpio_set(row, 0);
+    run_ms(VOLUME_RAMP_MS * 2);
+    CHECK(!timer_armed(TIMER_VOLUME_RAMP));
+    CHECK(volume == start + 5);
+
+    volume = start;
+    player_request(VOLUME);
+    CHECK(run_until_sent(3000));
+    CHECK(player_volume == start);
+}
+
+/**
+ * @brief A long press acts on the track that was playing before its short press
+ */
+// The track that the short press moved to leaves no history entry, no play
+// and no skip behind.
+static void session_long_press(){
+    num_tracks = NUM_TRACKS;
+    play_track(250, KEY_NONE);
+    run_ms(1000);
+    uint8_t history = track_history_count;
+    uint32_t plays = stats_total(false);
+    uint32_t skips = stats_total(true);
+    on_key_press(3); // Random, then genre shuffle
+    on_key_long_press(3);
+    run_ms(1000);
+    CHECK(shuffle_genre == genre_of(250) + 1);
+    CHECK(genre_of(current_track) == genre_of(250));
+    CHECK(track_history_count == history + 1);
+    CHECK(track_history[(uint8_t)(track_history_head - 1) & (HISTORY_SIZE - 1)] == 250);
+    CHECK(stats_total(false) == plays + 1);
+    CHECK(stats_total(true) == skips + 1); // 250 itself, left after a second
+    key_action(KEY_GENRE_SHUFFLE, 0);
+    CHECK(shuffle_genre == 0);
+
+    shuffling = false;
+    play_track(420, KEY_NONE);
+    run_ms(1000);
+    history = track_history_count;
+    uint16_t upcoming_track = upcoming_first(false);
+    plays = stats_total(false);
+    on_key_press(16); // Previous, then previous genre
+    on_key_long_press(16);
+    run_ms(1000);
+    CHECK(current_track == GENRES[genre_of(420) - 1].first);
+    CHECK(track_history_count == history + 1);
+    CHECK(track_history[(uint8_t)(track_history_head - 1) & (HISTORY_SIZE - 1)] == 420);
+    CHECK(upcoming_first(false) == upcoming_track);
+    CHECK(stats_total(false) == plays + 1);
+    num_tracks = SIM_FILE_COUNT;
+}
+
+/**
+ * @brief The clock is changed by core 1, which owns the UART
+ */
+static void session_clock(){
+    power_enter_idle();
+    CHECK(mock_clock_khz != POWER_IDLE_CLOCK_KHZ);
+    run_ms(10);
+    CHECK(mock_clock_khz == POWER_IDLE_CLOCK_KHZ);
+    CHECK(mock_clock_core == 1);
+    power_exit_idle();
+    run_ms(10);
+    CHECK(mock_clock_khz == RUN_CLOCK_KHZ);
+    CHECK(mock_clock_core == 1);
+
+    battery_set_profile(BATTERY_SAVING);
+    run_ms(10);
+    CHECK(mock_clock_khz == POWER_SAVING_CLOCK_KHZ);
+    CHECK(mock_clock_core == 1);
+    battery_set_profile(BATTERY_NORMAL);
+    run_ms(10);
+    CHECK(mock_clock_khz == RUN_CLOCK_KHZ);
+}
+
+/**
+ * @brief A track change requested during a fade-out is folded into the held one
+ */
+static void session_fade(){
+    CHECK(status == PLAYING);
+    uint32_t since = mock_frame_count;
+    current_track = 10;
+    player_request(PLAY);
+    run_ms(player_profile->min_gap_ms + 50);
+    CHECK(player_fade_command == PLAY);
+    current_track = 11;
+    player_request(PLAY);
+    CHECK(player_queue_head == player_queue_tail);
+    run_ms(FADE_MS * 3 + 1000);
+    CHECK(frame_count(since, FRAME_VOLUME) > 1);
+    CHECK(frame_count(since, FRAME_PLAY) == 1);
+    CHECK(frame_last(since, FRAME_PLAY) && frame_last(since, FRAME_PLAY)->arg == 11);
+    CHECK(frames_paced(since));
+    CHECK(player_volume == volume);
+}
+
+/**
+ * @brief A track requested while the next one is armed replaces it
+ */
+static void session_advance(){
+    CHECK(run_until_sent(5000));
+    uint32_t since = mock_frame_count;
+    uint16_t ended = player_last_track;
+    uint16_t completions = stats.record.tracks[ended - 1].completions;
+    player_next_track = 20;
+    mock_core = 1;
+    update_player_status(PAUSED_OR_IDLE); // The track has ended
+    mock_core = 0;
+    CHECK(player_advance_track == 20);
+    current_track = 21;
+    player_request(PLAY);
+    CHECK(run_until_sent(3000));
+    run_ms(500);
+    CHECK(frame_count(since, FRAME_PLAY) == 1);
+    CHECK(frame_last(since, FRAME_PLAY) && frame_last(since, FRAME_PLAY)->arg == 21);
+    CHECK(current_track == 21);
+    CHECK(stats.record.tracks[ended - 1].completions == completions + 1); // Played to the end all the same
+
+    // Left alone, the armed track is played and core 0 follows it
+    since = mock_frame_count;
+    player_next_track = 22;
+    mock_core = 1;
+    update_player_status(PAUSED_OR_IDLE);
+    mock_core = 0;
+    CHECK(run_until_sent(3000));
+    run_ms(500);
+    CHECK(frame_count(since, FRAME_PLAY) == 1);
+    CHECK(frame_last(since, FRAME_PLAY) && frame_last(since, FRAME_PLAY)->arg == 22);
+    CHECK(current_track == 22);
+    CHECK(stats.record.tracks[21 - 1].completions == 1);
+}
+
+/**
+ * @brief The shuffled playlist covers the tracks on the card, and no more
+ */
+static void session_shuffle(){
+    CHECK(num_tracks == SIM_FILE_COUNT);
+    random_track(); // Loads the playlist
+    randomize_playlist();
+    playlist_index = 1;
+    uint32_t epoch = shuffle_epoch;
+    uint8_t seen[SIM_FILE_COUNT + 1] = {0};
+    bool once = true;
+    for(uint16_t i = 0; i < SIM_FILE_COUNT; i++){
+        random_track();
+        if(current_track > SIM_FILE_COUNT || seen[current_track]++){ once = false; }
+    }
+    CHECK(once);
+    CHECK(shuffle_epoch == epoch + 1); // A whole pass, and a new playlist
+
+    // A new file count brings a new playlist over the new range
+    num_tracks = SIM_FILE_COUNT / 2;
+    run_ms(10);
+    CHECK(shuffle_epoch == epoch + 2);
+    CHECK(playlist_index == 1);
+    bool inside = true;
+    for(uint16_t i = 0; i < SIM_FILE_COUNT / 2; i++){
+        random_track();
+        if(current_track > SIM_FILE_COUNT / 2){ inside = false; }
+    }
+    CHECK(inside);
+    CHECK(shuffle_epoch == epoch + 3);
+    num_tracks = SIM_FILE_COUNT;
+    run_ms(10);
+
+    // The genre is clipped to the card too
+    shuffle_genre = 1;
+    CHECK(playlist_length() == SIM_FILE_COUNT);
+    shuffle_genre = 2;
+    CHECK(playlist_length() == 0);
+    uint16_t track = current_track;
+    random_track();
+    CHECK(current_track == track);
+    shuffle_genre = 0;
+    shuffling = false;
+    CHECK(run_until_sent(3000));
+}
+
+/**
+ * @brief The playback state and the play statistics come back from flash
+ */
+static void session_flash(){
+    current_track = 42;
+    state_save();
+    stats.record.tracks[5].plays = 9;
+    stats_save();
+    current_track = 1;
+    stats.record.tracks[5].plays = 0;
+    state_restore();
+    stats_restore();
+    CHECK(current_track == 42);
+    CHECK(stats.record.tracks[5].plays == 9);
+
+    // A write that could not lock core 1 out is tried again later
+    mock_flash_result = PICO_ERROR_TIMEOUT;
+    uint8_t sector = stats_sector;
+    uint16_t slot = state_slot;
+    current_track = 43;
+    state_save();
+    stats_changed();
+    stats_save();
+    CHECK(stats_sector == sector);
+    CHECK(stats_dirty);
+    CHECK(state_slot == slot);
+    CHECK(state_changed());
+    mock_flash_result = PICO_OK;
+    state_save();
+    stats_save();
+    CHECK(stats_sector != sector);
+    CHECK(!stats_dirty);
+    CHECK(!state_changed());
+    state_restore();
+    CHECK(current_track == 43);
+}
+
+/**
+ * @brief Probe the player again, as at boot
+ */
+static void probe(){
+    player_profile = &PLAYER_PROFILES[PROFILE_NO_STATUS];
+    player_probed = false;
+    player_probe_sent = 0;
+    player_probe_latency = 0;
+    run_ms(2 * PLAYER_PROBE_TIMEOUT_MS + 500);
+    CHECK(player_probed);
+}
+
+/**
+ * @brief A clone that only takes frames without a checksum, and gets its own checksums wrong
+ */
+// The bad reply comes to the second query, sent without a checksum
+static void session_probe_lenient(){
+    model_strict_rx = true;
+    model_bad_tx = true;
+    probe();
+    CHECK(player_profile == &PLAYER_PROFILES[PROFILE_LENIENT_RX_NO_CHECKSUM]);
+    CHECK(!player_profile->checksum_tx && !player_profile->checksum_rx);
+
+    // Commands reach the player, and its replies are taken in
+    uint32_t since = mock_frame_count;
+    uint16_t bad = player_rx_bad_checksum;
+    volume_up();
+    run_ms(status_interval_us() / 1000 + 500);
+    CHECK(frame_last(since, FRAME_VOLUME) && !frame_last(since, FRAME_VOLUME)->checksum);
+    CHECK(frame_count(since, FRAME_STATUS) > 0);
+    CHECK(player_rx_bad_checksum > bad);
+    volume_down();
+
+    model_strict_rx = false;
+    model_bad_tx = false;
+    probe();
+    CHECK(player_profile == &PLAYER_PROFILES[PROFILE_FAST]);
+}
+
+/**
+ * @brief Frame command sent for a player command
+ * @param command Player command
+ * @return Frame command
+ */
+static uint8_t frame_of(uint8_t command){
+    static const uint8_t frames[] = {
+        [STATUS] = FRAME_STATUS, [PLAY] = FRAME_PLAY, [VOLUME] = FRAME_VOLUME, [EQ] = FRAME_EQ,
+        [PAUSE] = FRAME_PAUSE, [RESUME] = FRAME_RESUME, [FILE_COUNT] = FRAME_FILE_COUNT,
+    };
+    return frames[command];
+}
+
+/**
+ * @brief Random bursts of requests, faster than core 1 can send them
+ * @param requests Incremented by the number of requests made
+ * @param frames Incremented by the number of frames sent for them
+ */
+// Core 1 does not run during a burst, so a shadow of the queue tells
+// exactly which requests are queued, coalesced or dropped. Every queued
+// request then has to go out as one frame once the queue has drained.
+static void session_bursts(uint32_t *requests, uint32_t *frames){
+    static const uint8_t commands[] = {PLAY, VOLUME, EQ, PAUSE, RESUME};
+    model_frozen = true; // Nothing ends, so that core 0 adds no requests of its own
+    for(uint8_t burst = 0; burst < SIM_BURSTS; burst++){
+        CHECK(player_queue_head == player_queue_tail);
+        uint32_t since = mock_frame_count;
+        uint16_t queued[FILE_COUNT + 1] = {0};
+        uint16_t dropped[FILE_COUNT + 1] = {0};
+        bool pending[FILE_COUNT + 1] = {false};
+        uint8_t length = 0;
+        trace_clear();
+
+        uint8_t n = 1 + sim_random(SIM_BURST_MAX);
+        for(uint8_t i = 0; i < n; i++){
+            uint8_t command = commands[sim_random(count_of(commands))];
+            // The value is written before the request, as the key actions do
+            if(command == PLAY){ current_track = 1 + sim_random(num_tracks); }
+            if(command == VOLUME){ volume = sim_random(VOLUME_MAX + 1); }
+            if(command == EQ){ eq = sim_random(6); }
+            player_request(command);
+            bool coalesce = (command == PLAY || command == VOLUME || command == EQ);
+            if(coalesce && pending[command]){ continue; }
+            if(length >= PLAYER_QUEUE_SIZE){
+                dropped[command]++;
+                continue;
+            }
+            length++;
+            queued[command]++;
+            if(coalesce){ pending[command] = true; }
+        }
+        *requests += n;
+
+        CHECK(run_until_sent(10000));
+        uint32_t fades = trace_count(1, TRACE_TX, FADE);
+        for(uint8_t command = PLAY; command <= RESUME; command++){
+            CHECK(trace_count(0, TRACE_QUEUED, command) == queued[command]);
+            CHECK(trace_count(0, TRACE_QUEUE_FULL, command) == dropped[command]);
+            CHECK(trace_count(1, TRACE_TX, command) == queued[command]);
+            CHECK(frame_count(since, frame_of(command)) == queued[command] + (command == VOLUME ? fades : 0));
+            *frames += queued[command];
+        }
+        *frames += fades;
+        // Coalesced requests go out with the value written last, and the fades end there
+        if(queued[PLAY]){ CHECK(frame_last(since, FRAME_PLAY) && frame_last(since, FRAME_PLAY)->arg == current_track); }
+        if(queued[VOLUME] && !is_paused){
+            CHECK(frame_last(since, FRAME_VOLUME) && frame_last(since, FRAME_VOLUME)->arg == volume);
+        }
+        if(queued[EQ]){ CHECK(frame_last(since, FRAME_EQ) && frame_last(since, FRAME_EQ)->arg == eq); }
+        CHECK(frames_paced(since));
+    }
+    model_frozen = false;
+}
+
+/**
+ * @brief Random key presses at a human rate: nothing is dropped, and every request goes out
+ * @param requests Incremented by the number of requests made
+ * @param frames Incremented by the number of frames sent for them
+ */
+static void session_keys(uint32_t *requests, uint32_t *frames){
+    static const uint8_t keys[] = {
+        0, 1, 2, 5, 6, 7, 10, 11, 12, 15,   // Digits
+        16, 17, 3, 19, 13, 8, 18,           // Prev, next, random, volume, repeat, pause
+        16 | KEY_LONG_PRESS, 17 | KEY_LONG_PRESS, 3 | KEY_LONG_PRESS, 13 | KEY_LONG_PRESS,
+    };
+    model_frozen = true;
+    trace_clear();
+    uint32_t since = mock_frame_count;
+    for(uint8_t i = 0; i < SIM_KEYS; i++){
+        uint8_t key = keys[sim_random(count_of(keys))];
+        if(key & KEY_LONG_PRESS){
+            on_key_long_press(key & ~KEY_LONG_PRESS);
+        } else {
+            on_key_press(key);
+        }
+        run_ms(150 + sim_random(450));
+    }
+    run_ms(INPUT_TIMEOUT_MS);
+    CHECK(run_until_sent(10000));
+    for(uint8_t command = PLAY; command <= RESUME; command++){
+        CHECK(trace_count(0, TRACE_QUEUE_FULL, command) == 0);
+        CHECK(trace_count(1, TRACE_TX, command) == trace_count(0, TRACE_QUEUED, command));
+        *requests += trace_count(0, TRACE_QUEUED, command);
+        *frames += trace_count(1, TRACE_TX, command);
+    }
+    *frames += trace_count(1, TRACE_TX, FADE);
+    CHECK(frames_paced(since));
+    model_frozen = false;
+}
+
+/**
+ * @brief Random sessions one after the other, each with its own seed, and their throughput
+ */
+static void session_random(){
+    uint32_t requests = 0;
+    uint32_t frames = 0;
+    uint64_t started_us = time_us_64();
+    clock_t started = clock();
+    // Frozen while playing, so that no track ends
+    model_playing = true;
+    mock_gpio_set(BUSY_PIN, 0);
+    run_ms(1000);
+    for(uint32_t seed = 1; seed <= SIM_SESSIONS; seed++){
+        int before = failures;
+        rng_state = seed * 2654435761u;
+        session_bursts(&requests, &frames);
+        session_keys(&requests, &frames);
+        if(failures != before){ printf("Random session with seed %u failed\n", (unsigned int)seed); }
+    }
+    double simulated_s = (time_us_64() - started_us) / 1e6;
+    double host_s = (double)(clock() - started) / CLOCKS_PER_SEC;
+    printf("%u random sessions: %u requests, %u frames sent in %.0fs simulated, %.2fs on the host\n",
+        SIM_SESSIONS, (unsigned int)requests, (unsigned int)frames, simulated_s, host_s);
+    printf("Throughput: %.1f requests and %.1f frames per simulated second\n",
+        requests / simulated_s, frames / simulated_s);
+}
+
+int main(){
+    session_boot();
+    session_coalescing();
+    session_drops();
+    session_dialing();
+    session_remote();
+    session_ramp();
+    session_long_press();
+    session_clock();
+    session_fade();
+    session_advance();
+    session_shuffle();
+    session_flash();
+    session_probe_lenient();
+    session_random();
+    if(failures){
+        printf("%d checks failed\n", failures);
+        return 1;
+    }
+    printf("All checks passed\n");
+    return 0;
+}